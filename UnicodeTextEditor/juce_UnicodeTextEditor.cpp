@@ -30,7 +30,7 @@ struct TextAtom
 {
     //==============================================================================
     juce::String atomText;
-    float width;
+    mutable float width;    // -1 until it's first needed, see UniformTextSection::getAtomWidth()
     int numChars;
 
     //==============================================================================
@@ -60,6 +60,13 @@ struct TextAtom
     JUCE_LEAK_DETECTOR (TextAtom)
 };
 
+//==============================================================================
+// returns a font scaled by the editor's zoom factor
+static juce::Font scaleFont (const juce::Font& font, float scale)
+{
+    return scale == 1.0f ? font : font.withHeight (font.getHeight() * scale);
+}
+
 //==============================================================================
 // a run of text with a single font and colour
 class UnicodeTextEditor::UniformTextSection
@@ -78,8 +85,14 @@ public:
 
     void append (UniformTextSection& other)
     {
+        expand();
+        other.expand();
+
         if (! other.atoms.isEmpty())
         {
+            // (joining two words up doesn't change the length, so it can be kept)
+            const auto newLength = getTotalLength() + other.getTotalLength();
+
             int i = 0;
 
             if (! atoms.isEmpty())
@@ -94,7 +107,7 @@ public:
                     {
                         lastAtom.atomText += first.atomText;
                         lastAtom.numChars = (juce::uint16) (lastAtom.numChars + first.numChars);
-                        lastAtom.width = font.getStringWidthFloat (lastAtom.getText (passwordChar));
+                        lastAtom.width = -1.0f;
                         ++i;
                     }
                 }
@@ -107,12 +120,17 @@ public:
                 atoms.add (other.atoms.getReference(i));
                 ++i;
             }
+
+            atomsChanged();
+            totalLength = newLength;
         }
     }
 
     UniformTextSection* split (int indexToBreakAt)
     {
+        expand();
         auto* section2 = new UniformTextSection ({}, font, colour, passwordChar);
+        section2->clock = clock;
         int index = 0;
 
         for (int i = 0; i < atoms.size(); ++i)
@@ -133,13 +151,13 @@ public:
             {
                 TextAtom secondAtom;
                 secondAtom.atomText = atom.atomText.substring (indexToBreakAt - index);
-                secondAtom.width = font.getStringWidthFloat (secondAtom.getText (passwordChar));
+                secondAtom.width = -1.0f;
                 secondAtom.numChars = (juce::uint16) secondAtom.atomText.length();
 
                 section2->atoms.add (secondAtom);
 
                 atom.atomText = atom.atomText.substring (0, indexToBreakAt - index);
-                atom.width = font.getStringWidthFloat (atom.getText (passwordChar));
+                atom.width = -1.0f;
                 atom.numChars = (juce::uint16) (indexToBreakAt - index);
 
                 for (int j = i + 1; j < atoms.size(); ++j)
@@ -152,21 +170,26 @@ public:
             index = nextIndex;
         }
 
+        atomsChanged();
+        section2->atomsChanged();
         return section2;
     }
 
     void appendAllText (juce::MemoryOutputStream& mo) const
     {
-        for (auto& atom : atoms)
+        for (auto& atom : getAtoms())
             mo << atom.atomText;
     }
 
     void appendSubstring (juce::MemoryOutputStream& mo, juce::Range<int> range) const
     {
-        int index = 0;
+        // (the first atom is looked up, as this is used to copy big sections in chunks)
+        auto atomIndex = findAtomContaining (juce::jmax (0, range.getStart()));
+        int index = getAtomStart (atomIndex);
 
-        for (auto& atom : atoms)
+        for (; atomIndex < atoms.size(); ++atomIndex)
         {
+            auto& atom = atoms.getReference (atomIndex);
             auto nextIndex = index + atom.numChars;
 
             if (range.getStart() < nextIndex)
@@ -184,16 +207,161 @@ public:
         }
     }
 
-    int getTotalLength() const noexcept
+    // Returns the size of the text in a range as UTF-8, so that it can be copied into a buffer
+    // that's exactly big enough. The size of the whole section is cached.
+    int getNumBytesAsUTF8 (juce::Range<int> range) const
     {
-        int total = 0;
+        const auto wholeSection = range.getStart() <= 0 && range.getEnd() >= getTotalLength();
 
-        for (auto& atom : atoms)
-            total += atom.numChars;
+        if (wholeSection && numBytes >= 0)
+            return numBytes;
+
+        int index = 0, total = 0;
+
+        for (auto& atom : getAtoms())
+        {
+            auto nextIndex = index + atom.numChars;
+            auto r = (range - index).getIntersectionWith ({ 0, (int) atom.numChars });
+
+            if (r.getLength() == (int) atom.numChars)
+                total += (int) atom.atomText.getNumBytesAsUTF8();
+            else if (! r.isEmpty())
+                total += (int) atom.atomText.substring (r.getStart(), r.getEnd()).getNumBytesAsUTF8();
+
+            index = nextIndex;
+        }
+
+        if (wholeSection)
+            numBytes = total;
 
         return total;
     }
 
+    int getTotalLength() const noexcept
+    {
+        if (totalLength < 0)
+        {
+            totalLength = 0;
+
+            for (auto& atom : atoms)
+                totalLength += atom.numChars;
+        }
+
+        return totalLength;
+    }
+
+    // The numbers of words and new-lines, where a word is a non-whitespace atom. Like the
+    // length, these are kept while the section is compressed.
+    int getNumWords() const             { updateCounts(); return numWords; }
+    int getNumNewLines() const          { updateCounts(); return numNewLines; }
+    bool startsWithWord() const         { updateCounts(); return firstIsWord; }
+    bool endsWithWord() const           { updateCounts(); return lastIsWord; }
+
+    // Returns an atom's width, measuring it if this is the first time it's been needed. Atoms
+    // aren't measured when they're created, so that text which never gets laid out is never
+    // measured at all.
+    float getAtomWidth (const TextAtom& atom) const
+    {
+        if (atom.width < 0)
+            atom.width = font.getStringWidthFloat (atom.getText (passwordChar));
+
+        return atom.width;
+    }
+
+    // Returns an atom's width at a zoom factor. That's the stored width scaled up, unless
+    // refineWidths() has measured the atom at this zoom factor, in which case it's the exact,
+    // hinted width it measured.
+    float getZoomedAtomWidth (const TextAtom& atom, float zoom) const
+    {
+        if (zoom == refinedZoom)
+        {
+            const auto atomIndex = (int) (&atom - atoms.begin());
+
+            if (juce::isPositiveAndBelow (atomIndex, refinedWidths.size()) && refinedWidths.getUnchecked (atomIndex) >= 0)
+                return refinedWidths.getUnchecked (atomIndex);
+        }
+
+        return getAtomWidth (atom) * zoom;
+    }
+
+    // returns the index of the atom containing the given character offset into this section
+    int findAtomContaining (int charIndex) const
+    {
+        updateAtomStarts();
+
+        auto upper = std::upper_bound (atomStarts.begin(), atomStarts.end(), charIndex);
+        return juce::jmax (0, (int) (upper - atomStarts.begin()) - 1);
+    }
+
+    // returns the character offset of an atom, or the section's length if atomIndex is past the end
+    int getAtomStart (int atomIndex) const
+    {
+        updateAtomStarts();
+        return atomIndex < atoms.size() ? atomStarts.getUnchecked (atomIndex) : getTotalLength();
+    }
+
+    // returns the total unzoomed width of the atoms in the range [startAtom, endAtom), as
+    // they'd be laid out at the given zoom factor
+    float getWidthOfAtoms (int startAtom, int endAtom, float zoom) const
+    {
+        updateAtomRights (zoom);
+
+        if (endAtom <= startAtom)
+            return 0.0f;
+
+        return atomRights.getUnchecked (endAtom - 1) - (startAtom > 0 ? atomRights.getUnchecked (startAtom - 1) : 0.0f);
+    }
+
+    // returns the first atom from startAtom onwards whose right-hand edge is beyond the given
+    // unzoomed distance from the left of startAtom, or the number of atoms if there isn't one
+    int findAtomEndingAfter (int startAtom, float distance, float zoom) const
+    {
+        updateAtomRights (zoom);
+
+        auto left = startAtom > 0 ? atomRights.getUnchecked (startAtom - 1) : 0.0f;
+        auto upper = std::upper_bound (atomRights.begin() + startAtom, atomRights.end(), left + distance);
+        return (int) (upper - atomRights.begin());
+    }
+
+    // Measures the atoms in the range [startAtom, endAtom) with the font scaled by a zoom
+    // factor. Returns true if any of their widths at that zoom factor changed.
+    // The stored widths are left alone, and the new ones are kept separately for this one
+    // zoom factor, so that zooming in and out again can't make the stored widths drift.
+    bool refineWidths (int startAtom, int endAtom, float zoom)
+    {
+        expand();
+
+        if (zoom != refinedZoom || refinedWidths.size() != atoms.size())
+        {
+            refinedZoom = zoom;
+            refinedWidths.clearQuick();
+            refinedWidths.insertMultiple (0, -1.0f, atoms.size());
+        }
+
+        const auto zoomedFont = scaleFont (font, zoom);
+        auto anyChanged = false;
+
+        for (int i = startAtom; i < endAtom; ++i)
+        {
+            auto& atom = atoms.getReference (i);
+
+            if (atom.isNewLine())
+                continue;
+
+            auto width = zoomedFont.getStringWidthFloat (atom.getText (passwordChar));
+
+            if (std::abs (width - getZoomedAtomWidth (atom, zoom)) > 0.001f)
+                anyChanged = true;
+
+            refinedWidths.setUnchecked (i, width);
+        }
+
+        if (anyChanged)
+            atomRights.clearQuick();
+
+        return anyChanged;
+    }
+
     void setFont (const juce::Font& newFont, const juce::juce_wchar passwordCharToUse)
     {
         if (font != newFont || passwordChar != passwordCharToUse)
@@ -201,18 +369,207 @@ public:
             font = newFont;
             passwordChar = passwordCharToUse;
 
+            // (a compressed section has no widths to forget, and its length and counts must be kept)
             for (auto& atom : atoms)
-                atom.width = newFont.getStringWidthFloat (atom.getText (passwordChar));
+                if (! atom.isNewLine())
+                    atom.width = -1.0f;
+
+            if (! isCompressed())
+                atomsChanged();
         }
     }
 
     //==============================================================================
+    // A compressed section keeps only its length; its atoms are rebuilt from the compressed
+    // text the next time anything asks for them.
+    const juce::Array<TextAtom>& getAtoms() const       { expand(); return atoms; }
+    juce::Array<TextAtom>& getAtoms()                   { expand(); return atoms; }
+
+    bool isCompressed() const noexcept                  { return ! compressedText.isEmpty(); }
+
+    // Replaces the atoms with a gzipped copy of their text. Returns false if the section
+    // can't be compressed, i.e. it's empty, or it has a lone carriage-return, which would
+    // get joined up with a following new-line when the text is parsed again.
+    bool compress()
+    {
+        if (isCompressed() || atoms.isEmpty())
+            return false;
+
+        for (auto& atom : atoms)
+            if (atom.atomText == "\r")
+                return false;
+
+        const auto length = getTotalLength();
+        const auto bytes = getNumBytesAsUTF8 ({ 0, length });
+        updateCounts();
+        const auto words = numWords, newLines = numNewLines;
+        const auto first = firstIsWord, last = lastIsWord;
+
+        {
+            juce::MemoryOutputStream out (compressedText, false);
+            juce::GZIPCompressorOutputStream gzip (out, 3);
+
+            for (auto& atom : atoms)
+                gzip << atom.atomText;
+        }
+
+        atoms.clear();
+        atomsChanged();
+        totalLength = length;
+        numBytes = bytes;
+        numWords = words;
+        numNewLines = newLines;
+        firstIsWord = first;
+        lastIsWord = last;
+        return true;
+    }
+
+    // these save and load the atoms' widths, see UnicodeTextEditor::saveLayoutCache()
+    void writeAtomWidths (juce::OutputStream& out) const
+    {
+        for (auto& atom : getAtoms())
+            out.writeFloat (atom.width);
+    }
+
+    void readAtomWidths (juce::InputStream& in)
+    {
+        for (auto& atom : getAtoms())
+            atom.width = in.readFloat();
+
+        atomsChanged();
+    }
+
+    // used to find the sections that have gone longest without being looked at
+    juce::uint32 getLastUseTime() const noexcept        { return lastUseTime; }
+
+    // the clock belongs to the editor that the section is in, and also counts the expansions,
+    // so that the editor can tell if there may be anything to compress again
+    void setClock (SectionClock* newClock) noexcept     { clock = newClock; }
+
+    void markAsUsed() const noexcept
+    {
+        if (clock != nullptr)
+            lastUseTime = ++(clock->time);
+    }
+
     juce::Font font;
     juce::Colour colour;
-    juce::Array<TextAtom> atoms;
     juce::juce_wchar passwordChar;
 
 private:
+    juce::Array<TextAtom> atoms;
+    juce::MemoryBlock compressedText;
+    SectionClock* clock = nullptr;
+    mutable juce::uint32 lastUseTime = 0;
+
+    mutable int totalLength = -1, numBytes = -1;
+    mutable int numWords = -1, numNewLines = 0;
+    mutable bool firstIsWord = false, lastIsWord = false;
+    mutable juce::Array<int> atomStarts;
+    mutable juce::Array<float> atomRights;
+    mutable bool atomRightsAreRefined = false;  // true if atomRights was built from refinedWidths
+    juce::Array<float> refinedWidths;           // zoomed widths measured at refinedZoom, or -1
+    float refinedZoom = 0.0f;
+
+    // expanding doesn't change the text, so this can happen behind a const reference
+    void expand() const
+    {
+        if (isCompressed())
+            const_cast<UniformTextSection*> (this)->decompress();
+    }
+
+    void decompress()
+    {
+        juce::MemoryBlock text;
+
+        {
+            juce::MemoryInputStream in (compressedText, false);
+            juce::GZIPDecompressorInputStream gzip (in);
+            gzip.readIntoMemoryBlock (text);
+        }
+
+        compressedText.reset();
+        markAsUsed();
+
+        if (clock != nullptr)
+            ++(clock->expansionCount);
+        initialiseAtoms (juce::String::fromUTF8 (static_cast<const char*> (text.getData()), (int) text.getSize()));
+    }
+
+    void atomsChanged() noexcept
+    {
+        totalLength = -1;
+        numBytes = -1;
+        numWords = -1;
+        atomStarts.clearQuick();
+        atomRights.clearQuick();
+        refinedWidths.clearQuick();
+    }
+
+    void updateAtomStarts() const
+    {
+        expand();
+
+        if (atomStarts.size() != atoms.size())
+        {
+            atomStarts.clearQuick();
+            atomStarts.ensureStorageAllocated (atoms.size());
+
+            int index = 0;
+
+            for (auto& atom : atoms)
+            {
+                atomStarts.add (index);
+                index += atom.numChars;
+            }
+        }
+    }
+
+    void updateCounts() const
+    {
+        if (numWords >= 0)
+            return;
+
+        expand();
+        numWords = numNewLines = 0;
+
+        for (auto& atom : atoms)
+        {
+            if (atom.isNewLine())
+                ++numNewLines;
+            else if (! atom.isWhitespace())
+                ++numWords;
+        }
+
+        firstIsWord = ! atoms.isEmpty() && ! atoms.getReference (0).isWhitespace();
+        lastIsWord  = ! atoms.isEmpty() && ! atoms.getReference (atoms.size() - 1).isWhitespace();
+    }
+
+    // This has to measure all of the atoms, so is only used when they're being skipped over.
+    // The edges are unzoomed, but they include any refined widths when laying out at the zoom
+    // factor those were measured at, so that skipping atoms breaks lines where stepping would.
+    void updateAtomRights (float zoom) const
+    {
+        expand();
+
+        const auto useRefined = (zoom == refinedZoom && ! refinedWidths.isEmpty());
+
+        if (atomRights.size() != atoms.size() || atomRightsAreRefined != useRefined)
+        {
+            atomRights.clearQuick();
+            atomRights.ensureStorageAllocated (atoms.size());
+            atomRightsAreRefined = useRefined;
+
+            float right = 0;
+
+            for (auto& atom : atoms)
+            {
+                right += useRefined ? getZoomedAtomWidth (atom, zoom) / zoom : getAtomWidth (atom);
+                atomRights.add (right);
+            }
+        }
+    }
+
     void initialiseAtoms (const juce::String& textToParse)
     {
         auto text = textToParse.getCharPointer();
@@ -262,10 +619,12 @@ private:
 
             TextAtom atom;
             atom.atomText = juce::String (start, numChars);
-            atom.width = (atom.isNewLine() ? 0.0f : font.getStringWidthFloat (atom.getText (passwordChar)));
+            atom.width = (atom.isNewLine() ? 0.0f : -1.0f);
             atom.numChars = (juce::uint16) numChars;
             atoms.add (atom);
         }
+
+        atomsChanged();
     }
 
     JUCE_LEAK_DETECTOR (UniformTextSection)
@@ -274,26 +633,110 @@ private:
 //==============================================================================
 struct UnicodeTextEditor::Iterator
 {
+private:
+    template <bool canWrap, bool isLeftJustified>
+    struct LayoutPolicy
+    {
+        static constexpr bool wraps = canWrap, leftJustified = isLeftJustified;
+    };
+
+    struct LayoutFunctions
+    {
+        bool (Iterator::*next)();
+        void (Iterator::*beginNewLine)();
+    };
+
+    template <bool canWrap, bool isLeftJustified>
+    static LayoutFunctions getLayoutFunctions() noexcept
+    {
+        using Policy = LayoutPolicy<canWrap, isLeftJustified>;
+        return { &Iterator::advance<Policy>, &Iterator::startNewLine<Policy> };
+    }
+
+    static LayoutFunctions chooseLayoutFunctions (const UnicodeTextEditor& ed) noexcept
+    {
+        const auto leftJustified = ! ed.justification.testFlags (juce::Justification::horizontallyCentred
+                                                                  | juce::Justification::right);
+        if (ed.wordWrap)
+            return leftJustified ? getLayoutFunctions<true, true>() : getLayoutFunctions<true, false>();
+
+        return leftJustified ? getLayoutFunctions<false, true>() : getLayoutFunctions<false, false>();
+    }
+
+public:
     Iterator (const UnicodeTextEditor& ed)
-      : sections (ed.sections),
+      : owner (ed),
+        sections (ed.sections),
+        folds (ed.foldedRanges),
         justification (ed.justification),
         bottomRight ((float) ed.getMaximumTextWidth(), (float) ed.getMaximumTextHeight()),
         wordWrapWidth ((float) ed.getWordWrapWidth()),
         passwordCharacter (ed.passwordCharacter),
         lineSpacing (ed.lineSpacing),
-        underlineWhitespace (ed.underlineWhitespace)
+        underlineWhitespace (ed.underlineWhitespace),
+        zoom (ed.zoomFactor),
+        layout (chooseLayoutFunctions (ed))
     {
         jassert (wordWrapWidth > 0);
 
         if (! sections.isEmpty())
         {
-            currentSection = sections.getUnchecked (sectionIndex);
+            setSection (sectionIndex);
+            beginNewLine();
+        }
 
-            if (currentSection != nullptr)
-                beginNewLine();
+        lineHeight = ed.currentFont.getHeight() * zoom;
+        setInlayIndex (0);
+    }
+
+    // Starts iterating at a logical line other than the first one, i.e. at an index that
+    // directly follows a new-line atom, whose top is already known.
+    Iterator (const UnicodeTextEditor& ed, int lineStartIndex, float lineTop)
+      : Iterator (ed, lineStartIndex, lineTop, ed.currentFont.getHeight() * ed.zoomFactor, 0.0f)
+    {
+        if (currentSection != nullptr)
+        {
+            lineHeight = 0;
+            beginNewLine();
         }
+    }
+
+    // Starts iterating at a logical line whose height and left edge are already known, so
+    // that the line doesn't need measuring again.
+    Iterator (const UnicodeTextEditor& ed, int lineStartIndex, float lineTop, float knownLineHeight, float lineLeft)
+      : owner (ed),
+        sections (ed.sections),
+        folds (ed.foldedRanges),
+        justification (ed.justification),
+        bottomRight ((float) ed.getMaximumTextWidth(), (float) ed.getMaximumTextHeight()),
+        wordWrapWidth ((float) ed.getWordWrapWidth()),
+        passwordCharacter (ed.passwordCharacter),
+        lineSpacing (ed.lineSpacing),
+        underlineWhitespace (ed.underlineWhitespace),
+        zoom (ed.zoomFactor),
+        layout (chooseLayoutFunctions (ed))
+    {
+        jassert (wordWrapWidth > 0);
+
+        indexInText = lineStartIndex;
+        lineY = lineTop;
+        lineHeight = knownLineHeight;
+        atomX = lineLeft;
 
-        lineHeight = ed.currentFont.getHeight();
+        foldIndex = (int) (std::upper_bound (folds.begin(), folds.end(), lineStartIndex,
+                                             [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); })
+                             - folds.begin());
+
+        setInlayIndex (ed.findInlayAtOrAfter (lineStartIndex));
+
+        int sectionStart = 0;
+        sectionIndex = ed.findSectionContaining (lineStartIndex, sectionStart);
+
+        if (sectionIndex < sections.size())
+        {
+            setSection (sectionIndex);
+            atomIndex = currentSection->findAtomContaining (lineStartIndex - sectionStart);
+        }
     }
 
     Iterator (const Iterator&) = default;
@@ -301,10 +744,31 @@ struct UnicodeTextEditor::Iterator
 
     //==============================================================================
     bool next()
+    {
+        return (this->*layout.next)();
+    }
+
+    void beginNewLine()
+    {
+        (this->*layout.beginNewLine)();
+    }
+
+    //==============================================================================
+    // The layout step, compiled separately for each combination of the settings that would
+    // otherwise have to be checked for every atom.
+    template <typename Policy>
+    bool advance()
     {
         if (atom == &longAtom && chunkLongAtom (true))
             return true;
 
+        if (atom == &foldAtom)
+            skipFoldedSections();
+
+        if (currentSection != nullptr
+             && nextInlayPosition <= (atom != nullptr ? indexInText + atom->numChars : indexInText))
+            return startInlay<Policy>();
+
         if (sectionIndex >= sections.size())
         {
             moveToEndOfLastAtom();
@@ -313,9 +777,9 @@ struct UnicodeTextEditor::Iterator
 
         bool forceNewLine = false;
 
-        if (atomIndex >= currentSection->atoms.size() - 1)
+        if (atomIndex >= currentSection->getAtoms().size() - 1)
         {
-            if (atomIndex >= currentSection->atoms.size())
+            if (atomIndex >= currentSection->getAtoms().size())
             {
                 if (++sectionIndex >= sections.size())
                 {
@@ -324,17 +788,17 @@ struct UnicodeTextEditor::Iterator
                 }
 
                 atomIndex = 0;
-                currentSection = sections.getUnchecked (sectionIndex);
+                setSection (sectionIndex);
             }
-            else
+            else if constexpr (Policy::wraps)
             {
-                auto& lastAtom = currentSection->atoms.getReference (atomIndex);
+                auto& lastAtom = currentSection->getAtoms().getReference (atomIndex);
 
                 if (! lastAtom.isWhitespace())
                 {
                     // handle the case where the last atom in a section is actually part of the same
                     // word as the first atom of the next section...
-                    float right = atomRight + lastAtom.width;
+                    float right = atomRight + getWidth (*currentSection, lastAtom);
                     float lineHeight2 = lineHeight;
                     float maxDescent2 = maxDescent;
 
@@ -342,18 +806,18 @@ struct UnicodeTextEditor::Iterator
                     {
                         auto* s = sections.getUnchecked (section);
 
-                        if (s->atoms.size() == 0)
+                        if (s->getAtoms().size() == 0)
                             break;
 
-                        auto& nextAtom = s->atoms.getReference (0);
+                        auto& nextAtom = s->getAtoms().getReference (0);
 
                         if (nextAtom.isWhitespace())
                             break;
 
-                        right += nextAtom.width;
+                        right += getWidth (*s, nextAtom);
 
-                        lineHeight2 = juce::jmax (lineHeight2, s->font.getHeight());
-                        maxDescent2 = juce::jmax (maxDescent2, s->font.getDescent());
+                        lineHeight2 = juce::jmax (lineHeight2, s->font.getHeight() * zoom);
+                        maxDescent2 = juce::jmax (maxDescent2, s->font.getDescent() * zoom);
 
                         if (shouldWrap (right))
                         {
@@ -364,7 +828,7 @@ struct UnicodeTextEditor::Iterator
                             break;
                         }
 
-                        if (s->atoms.size() > 1)
+                        if (s->getAtoms().size() > 1)
                             break;
                     }
                 }
@@ -379,23 +843,28 @@ struct UnicodeTextEditor::Iterator
             indexInText += atom->numChars;
 
             if (atom->isNewLine())
-                beginNewLine();
+                startNewLine<Policy>();
             else
                 isInPreviousAtom = true;
         }
 
-        atom = &(currentSection->atoms.getReference (atomIndex));
-        atomRight = atomX + atom->width;
+        atom = &(currentSection->getAtoms().getReference (atomIndex));
+
+        // folds always start at the beginning of a section
+        if (atomIndex == 0 && foldIndex < folds.size() && folds.getReference (foldIndex).range.getStart() == indexInText)
+            startFold();
+
+        atomRight = atomX + getWidth (*currentSection, *atom);
         ++atomIndex;
 
-        if (shouldWrap (atomRight) || forceNewLine)
+        if (Policy::wraps && (shouldWrap (atomRight) || forceNewLine))
         {
             if (atom->isWhitespace())
             {
                 // leave whitespace at the end of a line, but truncate it to avoid scrolling
                 atomRight = juce::jmin (atomRight, wordWrapWidth);
             }
-            else if (shouldWrap (atom->width))  // atom too big to fit on a line, so break it up..
+            else if (shouldWrap (getWidth (*currentSection, *atom)))  // atom too big to fit on a line, so break it up..
             {
                 longAtom = *atom;
                 longAtom.numChars = 0;
@@ -404,15 +873,55 @@ struct UnicodeTextEditor::Iterator
             }
             else
             {
-                beginNewLine();
-                atomRight = atomX + atom->width;
+                startNewLine<Policy>();
+                atomRight = atomX + getWidth (*currentSection, *atom);
             }
         }
 
         return true;
     }
 
-    void beginNewLine()
+    // Moves past the atoms before lineEnd whose right-hand edges are left of x, using the
+    // sections' cached atom positions rather than visiting each one. This must be called
+    // before the first call to next(), and only on a line that can't wrap.
+    void skipAtomsBefore (float x, int lineEnd)
+    {
+        jassert (atom == nullptr && currentSection != nullptr);
+
+        // an inlay's width isn't in the sections, so stop at the atom that it comes before
+        if (nextInlayPosition < lineEnd)
+            lineEnd = nextInlayPosition + 1;
+
+        auto sectionStart = indexInText - currentSection->getAtomStart (atomIndex);
+
+        for (;;)
+        {
+            auto sectionEnd = sectionStart + currentSection->getTotalLength();
+
+            // the last atom on the line is never skipped, so that a new-line is always seen
+            auto lastAtom = lineEnd < sectionEnd ? currentSection->findAtomContaining (lineEnd - 1 - sectionStart)
+                                                 : currentSection->getAtoms().size();
+
+            auto target = juce::jmin (lastAtom, currentSection->findAtomEndingAfter (atomIndex, (x - atomX) / zoom, zoom));
+
+            atomX += currentSection->getWidthOfAtoms (atomIndex, target, zoom) * zoom;
+            atomIndex = target;
+            indexInText = sectionStart + currentSection->getAtomStart (target);
+
+            if (target < currentSection->getAtoms().size()
+                 || sectionIndex + 1 >= sections.size()
+                 || sectionEnd >= lineEnd
+                 || (foldIndex < folds.size() && folds.getReference (foldIndex).range.getStart() == sectionEnd))
+                return;
+
+            setSection (++sectionIndex);
+            atomIndex = 0;
+            sectionStart = sectionEnd;
+        }
+    }
+
+    template <typename Policy>
+    void startNewLine()
     {
         lineY += lineHeight * lineSpacing;
         float lineWidth = 0;
@@ -421,10 +930,45 @@ struct UnicodeTextEditor::Iterator
         auto tempAtomIndex = atomIndex;
         auto* section = sections.getUnchecked (tempSectionIndex);
 
-        lineHeight = section->font.getHeight();
-        maxDescent = section->font.getDescent();
+        lineHeight = section->font.getHeight() * zoom;
+        maxDescent = section->font.getDescent() * zoom;
+
+        if constexpr (! Policy::wraps && Policy::leftJustified)
+        {
+            // nothing can wrap and the line needs no offset, so there's no need to measure it:
+            // only the fonts used before the next new-line matter
+            while (tempSectionIndex < sections.size())
+            {
+                bool checkSize = false;
+
+                if (tempAtomIndex >= section->getAtoms().size())
+                {
+                    if (++tempSectionIndex >= sections.size())
+                        break;
+
+                    tempAtomIndex = 0;
+                    section = sections.getUnchecked (tempSectionIndex);
+                    checkSize = true;
+                }
+
+                if (! juce::isPositiveAndBelow (tempAtomIndex, section->getAtoms().size())
+                     || section->getAtoms().getReference (tempAtomIndex).isNewLine())
+                    break;
+
+                if (checkSize)
+                {
+                    lineHeight = juce::jmax (lineHeight, section->font.getHeight() * zoom);
+                    maxDescent = juce::jmax (maxDescent, section->font.getDescent() * zoom);
+                }
+
+                ++tempAtomIndex;
+            }
+
+            atomX = 0;
+            return;
+        }
 
-        float nextLineWidth = (atom != nullptr) ? atom->width : 0.0f;
+        float nextLineWidth = (atom != nullptr) ? getWidth (*currentSection, *atom) : 0.0f;
 
         while (! shouldWrap (nextLineWidth))
         {
@@ -435,7 +979,7 @@ struct UnicodeTextEditor::Iterator
 
             bool checkSize = false;
 
-            if (tempAtomIndex >= section->atoms.size())
+            if (tempAtomIndex >= section->getAtoms().size())
             {
                 if (++tempSectionIndex >= sections.size())
                     break;
@@ -445,19 +989,19 @@ struct UnicodeTextEditor::Iterator
                 checkSize = true;
             }
 
-            if (! juce::isPositiveAndBelow (tempAtomIndex, section->atoms.size()))
+            if (! juce::isPositiveAndBelow (tempAtomIndex, section->getAtoms().size()))
                 break;
 
-            auto& nextAtom = section->atoms.getReference (tempAtomIndex);
-            nextLineWidth += nextAtom.width;
+            auto& nextAtom = section->getAtoms().getReference (tempAtomIndex);
+            nextLineWidth += getWidth (*section, nextAtom);
 
             if (shouldWrap (nextLineWidth) || nextAtom.isNewLine())
                 break;
 
             if (checkSize)
             {
-                lineHeight = juce::jmax (lineHeight, section->font.getHeight());
-                maxDescent = juce::jmax (maxDescent, section->font.getDescent());
+                lineHeight = juce::jmax (lineHeight, section->font.getHeight() * zoom);
+                maxDescent = juce::jmax (maxDescent, section->font.getDescent() * zoom);
             }
 
             ++tempAtomIndex;
@@ -468,8 +1012,13 @@ struct UnicodeTextEditor::Iterator
 
     float getJustificationOffsetX (float lineWidth) const
     {
-        if (justification.testFlags (juce::Justification::horizontallyCentred))    return juce::jmax (0.0f, (bottomRight.x - lineWidth) * 0.5f);
-        if (justification.testFlags (juce::Justification::right))                  return juce::jmax (0.0f, bottomRight.x - lineWidth);
+        return getJustificationOffsetX (justification, bottomRight.x, lineWidth);
+    }
+
+    static float getJustificationOffsetX (juce::Justification justification, float maxWidth, float lineWidth)
+    {
+        if (justification.testFlags (juce::Justification::horizontallyCentred))    return juce::jmax (0.0f, (maxWidth - lineWidth) * 0.5f);
+        if (justification.testFlags (juce::Justification::right))                  return juce::jmax (0.0f, maxWidth - lineWidth);
 
         return 0;
     }
@@ -480,6 +1029,18 @@ struct UnicodeTextEditor::Iterator
         if (atom == nullptr)
             return;
 
+        if (isFoldPlaceholder())
+        {
+            drawFoldPlaceholder (g, transform);
+            return;
+        }
+
+        if (isInlay())
+        {
+            drawInlay (g, transform);
+            return;
+        }
+
         if (passwordCharacter != 0 || (underlineWhitespace || ! atom->isWhitespace()))
         {
             jassert (atom->getTrimmedText (passwordCharacter).isNotEmpty());
@@ -489,11 +1050,11 @@ struct UnicodeTextEditor::Iterator
             
             attributedString.setJustification(justification);
             attributedString.setColour(currentSection->colour);
-            attributedString.setFont(currentSection->font);
+            attributedString.setFont(font);
             
             g.saveState();
             g.addTransform(transform);
-            attributedString.draw(g, {atomX, lineY, atom->width, lineHeight});
+            attributedString.draw(g, {atomX, lineY, getWidth (*currentSection, *atom), lineHeight});
             g.restoreState();
         }
     }
@@ -502,7 +1063,7 @@ struct UnicodeTextEditor::Iterator
     {
         auto startX    = juce::roundToInt (indexToX (underline.getStart()));
         auto endX      = juce::roundToInt (indexToX (underline.getEnd()));
-        auto baselineY = juce::roundToInt (lineY + currentSection->font.getAscent() + 0.5f);
+        auto baselineY = juce::roundToInt (lineY + font.getAscent() + 0.5f);
 
         juce::Graphics::ScopedSaveState state (g);
         g.addTransform (transform);
@@ -515,13 +1076,25 @@ struct UnicodeTextEditor::Iterator
         if (atom == nullptr)
             return;
 
+        if (isFoldPlaceholder())
+        {
+            drawFoldPlaceholder (g, transform);
+            return;
+        }
+
+        if (isInlay())
+        {
+            drawInlay (g, transform);
+            return;
+        }
+
         if (passwordCharacter != 0 || ! atom->isWhitespace())
         {
             juce::AttributedString attributedString;
             
             attributedString.setJustification(justification);
             attributedString.append(atom->getTrimmedText(passwordCharacter));
-            attributedString.setFont(currentSection->font);
+            attributedString.setFont(font);
             attributedString.setColour(currentSection->colour);
             
             if(!selected.isEmpty()) {
@@ -530,12 +1103,88 @@ struct UnicodeTextEditor::Iterator
             
             g.saveState();
             g.addTransform(transform);
-            attributedString.draw(g, {atomX, lineY, atom->width, lineHeight});
+            attributedString.draw(g, {atomX, lineY, getWidth (*currentSection, *atom), lineHeight});
             g.restoreState();
         }
     }
 
-    //==============================================================================
+    void drawFoldPlaceholder (juce::Graphics& g, juce::AffineTransform transform) const
+    {
+        if (isHiddenLines())
+            return;
+
+        auto area = juce::Rectangle<float> (atomX, lineY, getWidth (*currentSection, *atom), lineHeight).reduced (1.0f, 2.0f);
+
+        juce::Graphics::ScopedSaveState state (g);
+        g.addTransform (transform);
+
+        g.setColour (currentSection->colour.withMultipliedAlpha (0.15f));
+        g.fillRoundedRectangle (area, 3.0f);
+
+        g.setColour (currentSection->colour.withMultipliedAlpha (0.7f));
+        g.setFont (font);
+        g.drawText (atom->atomText, area, juce::Justification::centred, false);
+    }
+
+    void drawInlay (juce::Graphics& g, juce::AffineTransform transform) const
+    {
+        auto area = juce::Rectangle<float> (atomX, lineY, inlayAtom.width, lineHeight).reduced (1.0f, 2.0f);
+
+        juce::Graphics::ScopedSaveState state (g);
+        g.addTransform (transform);
+
+        g.setColour (currentInlay->colour.withMultipliedAlpha (0.15f));
+        g.fillRoundedRectangle (area, 3.0f);
+
+        g.setColour (currentInlay->colour);
+        g.setFont (font);
+        g.drawText (inlayAtom.atomText, area, juce::Justification::centred, false);
+    }
+
+    bool isFoldPlaceholder() const noexcept
+    {
+        return atom == &foldAtom;
+    }
+
+    // a fold that hides lines removed by the line filter, which has no placeholder
+    bool isHiddenLines() const noexcept
+    {
+        return isFoldPlaceholder() && folds.getReference (foldIndex).hidden;
+    }
+
+    // inlays are atoms without any characters, so they never contain an index
+    bool isInlay() const noexcept
+    {
+        return atom == &inlayAtom;
+    }
+
+    juce::Colour getColour() const noexcept
+    {
+        return currentSection->colour;
+    }
+
+    const juce::Font& getFont() const noexcept
+    {
+        return font;
+    }
+
+    juce::String getAtomText() const
+    {
+        return atom->getText (passwordCharacter);
+    }
+
+    float getAtomWidth() const
+    {
+        return getWidth (*currentSection, *atom);
+    }
+
+    // the number of new-lines hidden by the fold placeholder that is the current atom
+    int getNumFoldedNewLines() const noexcept
+    {
+        return isFoldPlaceholder() ? folds.getReference (foldIndex).numNewLines : 0;
+    }
+
+    //==============================================================================
     float indexToX (int indexToFind) const
     {
         if (indexToFind <= indexInText || atom == nullptr)
@@ -545,7 +1194,7 @@ struct UnicodeTextEditor::Iterator
             return atomRight;
 
         juce::GlyphArrangement g;
-        g.addLineOfText (currentSection->font,
+        g.addLineOfText (font,
                          atom->getText (passwordCharacter),
                          atomX, 0.0f);
 
@@ -563,8 +1212,14 @@ struct UnicodeTextEditor::Iterator
         if (xToFind >= atomRight)
             return indexInText + atom->numChars;
 
+        if (isFoldPlaceholder())
+            return xToFind < (atomX + atomRight) * 0.5f ? indexInText : indexInText + atom->numChars;
+
+        if (isInlay())
+            return indexInText;
+
         juce::GlyphArrangement g;
-        g.addLineOfText (currentSection->font,
+        g.addLineOfText (font,
                          atom->getText (passwordCharacter),
                          atomX, 0.0f);
 
@@ -656,16 +1311,113 @@ struct UnicodeTextEditor::Iterator
     const TextAtom* atom = nullptr;
 
 private:
+    const UnicodeTextEditor& owner;
     const juce::OwnedArray<UniformTextSection>& sections;
+    const juce::Array<FoldedRange>& folds;
     const UniformTextSection* currentSection = nullptr;
-    int sectionIndex = 0, atomIndex = 0;
+    const Inlay* currentInlay = nullptr;
+    int sectionIndex = 0, atomIndex = 0, foldIndex = 0, inlayIndex = 0;
+    int nextInlayPosition = 0;
     juce::Justification justification;
     const juce::Point<float> bottomRight;
     const float wordWrapWidth;
     const juce::juce_wchar passwordCharacter;
     const float lineSpacing;
     const bool underlineWhitespace;
-    TextAtom longAtom;
+    const float zoom;
+    const LayoutFunctions layout;
+    juce::Font font;    // the current section's font, scaled by the zoom factor
+    TextAtom longAtom, foldAtom, inlayAtom;
+
+    void setSection (int index)
+    {
+        currentSection = sections.getUnchecked (index);
+        currentSection->markAsUsed();
+        font = scaleFont (currentSection->font, zoom);
+    }
+
+    // the widths stored in the sections' atoms are unzoomed, but the long-atom, fold
+    // placeholder and inlay atoms are measured with the zoomed font
+    float getWidth (const UniformTextSection& section, const TextAtom& a) const
+    {
+        return &a == &longAtom || &a == &foldAtom || &a == &inlayAtom ? a.width : section.getZoomedAtomWidth (a, zoom);
+    }
+
+    void setInlayIndex (int index)
+    {
+        inlayIndex = index;
+        nextInlayPosition = index < owner.inlays.size() ? owner.getInlayPosition (index)
+                                                        : std::numeric_limits<int>::max();
+    }
+
+    // Returns the next inlay as an atom with no characters, in front of the one that would
+    // otherwise come next. The inlay's width is kept, so it's only measured again if the
+    // font changes.
+    template <typename Policy>
+    bool startInlay()
+    {
+        if (atom != nullptr)
+        {
+            atomX = atomRight;
+            indexInText += atom->numChars;
+
+            if (atom->isNewLine())
+                startNewLine<Policy>();
+        }
+
+        currentInlay = &owner.inlays.getReference (inlayIndex);
+        setInlayIndex (inlayIndex + 1);
+
+        if (currentInlay->width < 0 || currentInlay->measuredFont != font)
+        {
+            currentInlay->measuredFont = font;
+            currentInlay->width = font.getStringWidthFloat (currentInlay->text) + font.getHeight() * 0.5f;
+        }
+
+        inlayAtom.atomText = currentInlay->text;
+        inlayAtom.numChars = 0;
+        inlayAtom.width = currentInlay->width;
+        atom = &inlayAtom;
+        atomRight = atomX + inlayAtom.width;
+
+        if (Policy::wraps && shouldWrap (atomRight))
+        {
+            startNewLine<Policy>();
+            atomRight = atomX + inlayAtom.width;
+        }
+
+        return true;
+    }
+
+    void startFold()
+    {
+        const auto& fold = folds.getReference (foldIndex);
+
+        foldAtom.atomText = fold.hidden ? juce::String() : juce::String (juce::CharPointer_UTF8 ("\xe2\x80\xa6"));
+        foldAtom.numChars = fold.range.getLength();
+        foldAtom.width = fold.hidden ? 0.0f : font.getStringWidthFloat (foldAtom.atomText) + font.getHeight() * 0.5f;
+        atom = &foldAtom;
+    }
+
+    // Jumps straight to the section that follows the fold which has just been returned,
+    // without looking at any of the atoms inside it.
+    void skipFoldedSections()
+    {
+        const auto foldEnd = folds.getReference (foldIndex++).range.getEnd();
+        auto index = indexInText;
+
+        while (nextInlayPosition < foldEnd)
+            setInlayIndex (inlayIndex + 1);
+
+        while (sectionIndex < sections.size() && index < foldEnd)
+            index += sections.getUnchecked (sectionIndex++)->getTotalLength();
+
+        jassert (index == foldEnd);
+        atomIndex = 0;
+
+        if (sectionIndex < sections.size())
+            setSection (sectionIndex);
+    }
 
     bool chunkLongAtom (bool shouldStartNewLine)
     {
@@ -678,7 +1430,7 @@ private:
         indexInText += longAtom.numChars;
 
         juce::GlyphArrangement g;
-        g.addLineOfText (currentSection->font, atom->getText (passwordCharacter), 0.0f, 0.0f);
+        g.addLineOfText (font, atom->getText (passwordCharacter), 0.0f, 0.0f);
 
         int split;
         for (split = 0; split < g.getNumGlyphs(); ++split)
@@ -725,195 +1477,2383 @@ private:
     JUCE_LEAK_DETECTOR (Iterator)
 };
 
-
 //==============================================================================
-struct UnicodeTextEditor::InsertAction  : public juce::UndoableAction
+// Keeps the position of every visual line, so that the editor doesn't need to re-run the
+// whole layout to find out where a line is. After an edit, only the logical lines that
+// were touched get laid out again; the lines after them are just shifted.
+struct UnicodeTextEditor::LineIndex
 {
-    InsertAction (UnicodeTextEditor& ed, const juce::String& newText, int insertPos,
-                  const juce::Font& newFont, juce::Colour newColour, int oldCaret, int newCaret)
-        : owner (ed),
-          text (newText),
-          insertIndex (insertPos),
-          oldCaretPos (oldCaret),
-          newCaretPos (newCaret),
-          font (newFont),
-          colour (newColour)
+    struct Line
     {
-    }
+        int startIndex, numChars;   // numChars includes any trailing new-line
+        int logicalLine;            // zero-based paragraph number
+        float y, height;            // as used by the Iterator, i.e. without line spacing
+        float left, right;
+        bool startsLogicalLine;
+        bool clipped;               // true if trailing whitespace was cut short at the wrap width
+        bool estimated;             // true if this is a whole logical line that hasn't been laid out yet
+        LineSummary summary;
+    };
 
-    bool perform() override
+    explicit LineIndex (const UnicodeTextEditor& ed)  : owner (ed) {}
+
+    //==============================================================================
+    void invalidateAll() noexcept
     {
-        owner.insert (text, insertIndex, font, colour, nullptr, newCaretPos);
-        return true;
+        needsRebuild = true;
     }
 
-    bool undo() override
+    void textChanged (int start, int numRemoved, int numInserted) noexcept
     {
-        owner.remove ({ insertIndex, insertIndex + text.length() }, nullptr, oldCaretPos);
-        return true;
+        if (! hasDirtyRange)
+        {
+            dirtyStart = start;
+            dirtyEnd = start + numInserted;
+            dirtyDelta = numInserted - numRemoved;
+            hasDirtyRange = true;
+            return;
+        }
+
+        // map the end of the existing dirty range through this edit, then merge the two
+        const auto removedEnd = start + numRemoved;
+        const auto end = dirtyEnd <= start ? dirtyEnd
+                                           : (dirtyEnd >= removedEnd ? dirtyEnd + numInserted - numRemoved
+                                                                     : start + numInserted);
+
+        dirtyStart = juce::jmin (dirtyStart, start);
+        dirtyEnd = juce::jmax (end, start + numInserted);
+        dirtyDelta += numInserted - numRemoved;
     }
 
-    int getSizeInUnits() override
+    void update()
     {
-        return text.length() + 16;
-    }
+        const Parameters newParameters (owner);
 
-private:
-    UnicodeTextEditor& owner;
-    const juce::String text;
-    const int insertIndex, oldCaretPos, newCaretPos;
-    const juce::Font font;
-    const juce::Colour colour;
+        if (! owner.multiline
+             && (needsRebuild || lines.isEmpty() || hasDirtyRange || newParameters != parameters)
+             && layOutSingleLine (newParameters))
+        {
+            needsRebuild = false;
+            hasDirtyRange = false;
+            return;
+        }
 
-    JUCE_DECLARE_NON_COPYABLE (InsertAction)
-};
+        if (needsRebuild || lines.isEmpty()
+             || (newParameters != parameters && (hasDirtyRange || ! newParameters.differsOnlyInWidth (parameters))))
+        {
+            parameters = newParameters;
+            rebuild();
+        }
+        else if (newParameters != parameters)
+        {
+            parameters = newParameters;
 
-//==============================================================================
-struct UnicodeTextEditor::RemoveAction  : public juce::UndoableAction
-{
-    RemoveAction (UnicodeTextEditor& ed, juce::Range<int> rangeToRemove, int oldCaret, int newCaret,
-                  const juce::Array<UniformTextSection*>& oldSections)
-        : owner (ed),
-          range (rangeToRemove),
-          oldCaretPos (oldCaret),
-          newCaretPos (newCaret)
+            rewrap (0, owner.deferredRewrap || firstStaleLine >= 0 ? getLayoutLimit() : -1.0f, 0);
+        }
+        else if (hasDirtyRange)
+        {
+            relayDirtyLines();
+        }
+        else
+        {
+            return;
+        }
+
+        needsRebuild = false;
+        hasDirtyRange = false;
+        geometryCache.clear();
+    }
+
+    // True if some of the lines are still wrapped at an old width, or are only estimates that
+    // haven't been laid out yet.
+    bool isLayoutPending() const noexcept
     {
-        removedSections.addArray (oldSections);
+        return firstStaleLine >= 0;
     }
 
-    bool perform() override
+    // the index where the first line that's still to be laid out starts, or the end of the text
+    int getLaidOutEnd() const noexcept
     {
-        owner.remove (range, nullptr, newCaretPos);
-        return true;
+        return firstStaleLine >= 0 ? lines.getReference (firstStaleLine).startIndex
+                                   : owner.getTotalNumChars();
     }
 
-    bool undo() override
+    // Lays out more of the lines that are pending, until the given millisecond counter time
+    // (or all of them, if the deadline is 0).
+    void continueLayout (double deadline)
     {
-        owner.reinsert (range.getStart(), removedSections);
-        owner.moveCaretTo (oldCaretPos, false);
-        return true;
+        update();
+
+        if (firstStaleLine >= 0)
+        {
+            rewrap (firstStaleLine, -1.0f, deadline);
+            geometryCache.clear();
+        }
     }
 
-    int getSizeInUnits() override
+    // Makes sure that all the lines above a position have been laid out, returning true if
+    // any had to be.
+    bool layOutDownTo (float y)
     {
-        int n = 16;
+        update();
 
-        for (auto* s : removedSections)
-            n += s->getTotalLength();
+        if (firstStaleLine < 0 || lines.getReference (firstStaleLine).y > y)
+            return false;
 
-        return n;
+        rewrap (firstStaleLine, y, 0);
+        geometryCache.clear();
+        return true;
     }
 
-private:
-    UnicodeTextEditor& owner;
-    const juce::Range<int> range;
-    const int oldCaretPos, newCaretPos;
-    juce::OwnedArray<UniformTextSection> removedSections;
-
-    JUCE_DECLARE_NON_COPYABLE (RemoveAction)
-};
+    //==============================================================================
+    // All of these bring the index up to date first, apart from getLine(), which is meant
+    // to be used with a line number that one of the others has just returned.
+    int getNumLines()                                   { update(); return lines.size(); }
+    int getNumLogicalLines()                            { update(); return lines.getReference (lines.size() - 1).logicalLine + 1; }
+    const Line& getLine (int index) const noexcept      { return lines.getReference (index); }
+
+    // returns the visual line containing a character index
+    int findLineContainingIndex (int index)
+    {
+        update();
+        return indexOfLineContaining (index);
+    }
 
-//==============================================================================
-struct UnicodeTextEditor::TextHolderComponent  : public juce::Component,
-public juce::Timer,
-                                          public juce::Value::Listener
-{
-    TextHolderComponent (UnicodeTextEditor& ed)  : owner (ed)
+    // returns the first visual line whose bottom is below the given y position
+    int findLineAtY (float y)
     {
-        setWantsKeyboardFocus (false);
-        setInterceptsMouseClicks (false, true);
-        setMouseCursor (juce::MouseCursor::ParentCursor);
+        update();
 
-        owner.getTextValue().addListener (this);
+        auto lower = std::lower_bound (lines.begin(), lines.end(), y,
+                                       [] (const Line& l, float yToFind) { return l.y + l.height <= yToFind; });
+
+        return juce::jmin (lines.size() - 1, (int) (lower - lines.begin()));
     }
 
-    ~TextHolderComponent() override
+    //==============================================================================
+    // The position of one atom on a line, as found by running the iterator over it.
+    struct AtomGeometry
     {
-        owner.getTextValue().removeListener (this);
-    }
+        int startIndex, numChars;
+        float x, right;
+        bool isNewLine, isFoldPlaceholder;
+        juce::String text;
+        juce::Font font;
+        juce::Array<float> glyphLefts, glyphCentres;   // filled in when first needed
+    };
 
-    void paint (juce::Graphics& g) override
+    // returns the atoms on a visual line, laying the line out again if it isn't in the cache
+    juce::Array<AtomGeometry>& getLineGeometry (int lineNum)
     {
-        owner.drawContent (g);
+        update();
+
+        for (auto* g : geometryCache)
+            if (g->lineNum == lineNum)
+                return g->atoms;
+
+        auto first = lineNum;
+
+        while (first > 0 && ! lines.getReference (first).startsLogicalLine)
+            --first;
+
+        const auto& firstLine = lines.getReference (first);
+        Iterator i = first == 0 ? Iterator (owner)
+                                : Iterator (owner, firstLine.startIndex, firstLine.y);
+
+        const auto& line = lines.getReference (lineNum);
+        const auto lineEnd = line.startIndex + line.numChars;
+
+        if (geometryCache.size() >= maxCachedGeometries)
+            geometryCache.remove (0);
+
+        auto* geometry = geometryCache.add (new LineGeometry { lineNum, {} });
+
+        while (i.next() && i.indexInText < lineEnd)
+            if (i.indexInText >= line.startIndex)
+                geometry->atoms.add ({ i.indexInText, i.atom->numChars, i.atomX, i.atomRight,
+                                       i.atom->isNewLine(), i.isFoldPlaceholder(), i.getAtomText(), i.getFont(), {}, {} });
+
+        return geometry->atoms;
     }
 
-    void restartTimer()
+    // finds the character index nearest to a position, in the same way as the iterator's xToIndex()
+    int indexAtPosition (float x, float y)
     {
-        startTimer (350);
+        auto lineNum = findLineAtY (y);
+        const auto& line = lines.getReference (lineNum);
+
+        if (y >= line.y + line.height || line.numChars == 0)
+            return owner.getTotalNumChars();
+
+        if (y < line.y)
+            return juce::jmax (0, line.startIndex - 1);
+
+        return indexAtX (lineNum, x);
     }
 
-    void timerCallback() override
+    // Returns the characters on each visual line from firstLine to lastLine that lie between
+    // two x positions, as used for box selections; past the end of a line, this stops at its
+    // last character. A box can cover far more lines than the geometry cache holds, so the
+    // lines are all found with one pass of the iterator instead.
+    juce::Array<juce::Range<int>> findRangesBetween (int firstLine, int lastLine, float x1, float x2)
     {
-        owner.timerCallbackInt();
+        update();
+
+        auto first = firstLine;
+
+        while (first > 0 && ! lines.getReference (first).startsLogicalLine)
+            --first;
+
+        const auto& firstLogicalLine = lines.getReference (first);
+        Iterator i = first == 0 ? Iterator (owner)
+                                : Iterator (owner, firstLogicalLine.startIndex, firstLogicalLine.y);
+
+        juce::Array<juce::Range<int>> ranges;
+        juce::Array<AtomGeometry> atoms;
+        auto hasAtom = i.next();
+
+        for (int n = firstLine; n <= lastLine; ++n)
+        {
+            const auto& line = lines.getReference (n);
+            const auto lineEnd = line.startIndex + line.numChars;
+            atoms.clearQuick();
+
+            for (; hasAtom && i.indexInText < lineEnd; hasAtom = i.next())
+                if (i.indexInText >= line.startIndex)
+                    atoms.add ({ i.indexInText, i.atom->numChars, i.atomX, i.atomRight,
+                                 i.atom->isNewLine(), i.isFoldPlaceholder(), i.getAtomText(), i.getFont(), {}, {} });
+
+            ranges.add (juce::Range<int>::between (indexAtX (atoms, n, x1), indexAtX (atoms, n, x2)));
+        }
+
+        return ranges;
     }
 
-    void valueChanged (juce::Value&) override
+    // finds the character index on a visual line that's nearest to an x position
+    int indexAtX (int lineNum, float x)
     {
-        owner.textWasChangedByValue();
+        return indexAtX (getLineGeometry (lineNum), lineNum, x);
     }
 
-    UnicodeTextEditor& owner;
-
-private:
-    std::unique_ptr<juce::AccessibilityHandler> createAccessibilityHandler() override
+    int indexAtX (juce::Array<AtomGeometry>& atoms, int lineNum, float x)
     {
-        return createIgnoredAccessibilityHandler (*this);
+        auto atom = std::upper_bound (atoms.begin(), atoms.end(), x,
+                                      [] (float xToFind, const AtomGeometry& a) { return xToFind < a.right; });
+
+        if (atom == atoms.end())
+        {
+            if (! atoms.isEmpty() && atoms.getReference (atoms.size() - 1).isNewLine)
+                return atoms.getReference (atoms.size() - 1).startIndex;
+
+            // past the end of a wrapped line, so use the last character on it
+            return lineNum + 1 < lines.size() ? lines.getReference (lineNum + 1).startIndex - 1
+                                              : owner.getTotalNumChars();
+        }
+
+        if (x <= atom->x || atom->isNewLine || atom->numChars == 0)
+            return atom->startIndex;
+
+        if (atom->isFoldPlaceholder)
+            return x < (atom->x + atom->right) * 0.5f ? atom->startIndex : atom->startIndex + atom->numChars;
+
+        measureGlyphs (*atom);
+
+        auto glyph = std::upper_bound (atom->glyphCentres.begin(), atom->glyphCentres.end(), x);
+        return atom->startIndex + (int) (glyph - atom->glyphCentres.begin());
     }
 
-    JUCE_DECLARE_NON_COPYABLE (TextHolderComponent)
-};
+    // the equivalent of Iterator::getCharPosition()
+    void getCharPosition (int index, juce::Point<float>& anchor, float& lineHeightFound)
+    {
+        auto lineNum = findLineContainingIndex (index);
+        const auto& line = lines.getReference (lineNum);
+        lineHeightFound = line.height;
 
-//==============================================================================
-struct UnicodeTextEditor::TextEditorViewport  : public juce::Viewport
-{
-    TextEditorViewport (UnicodeTextEditor& ed) : owner (ed) {}
+        if (line.numChars == 0)
+        {
+            anchor = { line.left, line.y };
+            return;
+        }
+
+        auto& atoms = getLineGeometry (lineNum);
+        auto atom = std::upper_bound (atoms.begin(), atoms.end(), index,
+                                      [] (int i, const AtomGeometry& a) { return i < a.startIndex + a.numChars; });
+
+        anchor = { atom != atoms.end() ? indexToX (*atom, index) : line.right, line.y };
+    }
 
-    void visibleAreaChanged (const juce::Rectangle<int>&) override
+    // the equivalent of calling Iterator::getTextBounds() for each atom in the range
+    juce::RectangleList<int> getTextBounds (juce::Range<int> range)
     {
-        if (! reentrant) // it's rare, but possible to get into a feedback loop as the viewport's scrollbars
-                         // appear and disappear, causing the wrap width to change.
+        juce::RectangleList<int> bounds;
+
+        for (int n = findLineContainingIndex (range.getStart()); n < lines.size(); ++n)
         {
-            auto wordWrapWidth = owner.getWordWrapWidth();
+            const auto& line = lines.getReference (n);
 
-            if (wordWrapWidth != lastWordWrapWidth)
+            if (line.startIndex >= range.getEnd())
+                break;
+
+            const juce::Range<int> lineRange (line.startIndex, line.startIndex + line.numChars);
+
+            if (! lineRange.intersects (range))
+                continue;
+
+            auto x1 = line.left, x2 = line.right;
+
+            // only lines that are partly inside the range need their atoms looking at
+            if (! range.contains (lineRange))
             {
-                lastWordWrapWidth = wordWrapWidth;
+                x1 = line.right;
+                x2 = line.left;
 
-                juce::ScopedValueSetter<bool> svs (reentrant, true);
-                owner.checkLayout();
+                for (auto& atom : getLineGeometry (n))
+                {
+                    if (range.intersects ({ atom.startIndex, atom.startIndex + atom.numChars }))
+                    {
+                        x1 = juce::jmin (x1, indexToX (atom, range.getStart()));
+                        x2 = juce::jmax (x2, indexToX (atom, range.getEnd()));
+                    }
+                }
             }
+
+            bounds.add (juce::Rectangle<float> (x1, line.y, x2 - x1, line.height * parameters.lineSpacing).getSmallestIntegerContainer());
         }
+
+        return bounds;
     }
 
-private:
-    std::unique_ptr<juce::AccessibilityHandler> createAccessibilityHandler() override
+    // returns the atom under a position, if there is one
+    const AtomGeometry* findAtomAt (float x, float y)
     {
-        return createIgnoredAccessibilityHandler (*this);
-    }
+        auto lineNum = findLineAtY (y);
+        const auto& line = lines.getReference (lineNum);
 
-    UnicodeTextEditor& owner;
-    int lastWordWrapWidth = 0;
-    bool reentrant = false;
+        if (y < line.y || y >= line.y + line.height)
+            return nullptr;
 
-    JUCE_DECLARE_NON_COPYABLE (TextEditorViewport)
-};
+        for (auto& atom : getLineGeometry (lineNum))
+            if (x >= atom.x && x < atom.right)
+                return &atom;
+
+        return nullptr;
+    }
+
+    float getYOffset()
+    {
+        update();
+
+        auto& last = lines.getReference (lines.size() - 1);
+        auto maxHeight = (float) owner.getMaximumTextHeight();
+
+        if (owner.justification.testFlags (juce::Justification::top) || last.y >= maxHeight)
+            return 0;
+
+        auto bottom = juce::jmax (0.0f, maxHeight - last.y - last.height);
+
+        if (owner.justification.testFlags (juce::Justification::bottom))
+            return bottom;
+
+        return bottom * 0.5f;
+    }
+
+    int getTotalTextHeight()
+    {
+        auto yOffset = getYOffset();
+        auto& last = lines.getReference (lines.size() - 1);
+        auto height = last.y + last.height + yOffset;
+
+        if (lines.size() > 1 && last.numChars == 0)
+            height += last.height;
+
+        return juce::roundToInt (height);
+    }
+
+    int getTextRight()
+    {
+        update();
+        return juce::roundToInt (textRight);
+    }
+
+private:
+    //==============================================================================
+    struct Parameters
+    {
+        Parameters() = default;
+
+        explicit Parameters (const UnicodeTextEditor& ed)
+            : wordWrapWidth (ed.getWordWrapWidth()),
+              maximumTextWidth (ed.getMaximumTextWidth()),
+              firstLineHeight (ed.currentFont.getHeight()),
+              lineSpacing (ed.lineSpacing),
+              zoomFactor (ed.zoomFactor),
+              justificationFlags (ed.justification.getOnlyHorizontalFlags()),
+              passwordCharacter (ed.passwordCharacter)
+        {
+        }
+
+        bool operator== (const Parameters& other) const noexcept
+        {
+            return wordWrapWidth == other.wordWrapWidth
+                && maximumTextWidth == other.maximumTextWidth
+                && firstLineHeight == other.firstLineHeight
+                && lineSpacing == other.lineSpacing
+                && zoomFactor == other.zoomFactor
+                && justificationFlags == other.justificationFlags
+                && passwordCharacter == other.passwordCharacter;
+        }
+
+        bool operator!= (const Parameters& other) const noexcept   { return ! operator== (other); }
+
+        // true if only the widths differ, and they can't have moved any lines sideways
+        bool differsOnlyInWidth (const Parameters& other) const noexcept
+        {
+            return firstLineHeight == other.firstLineHeight
+                && lineSpacing == other.lineSpacing
+                && zoomFactor == other.zoomFactor
+                && justificationFlags == other.justificationFlags
+                && passwordCharacter == other.passwordCharacter
+                && ! juce::Justification (justificationFlags).testFlags (juce::Justification::horizontallyCentred
+                                                                          | juce::Justification::right);
+        }
+
+        int wordWrapWidth = 0, maximumTextWidth = 0;
+        float firstLineHeight = 0, lineSpacing = 0, zoomFactor = 0;
+        int justificationFlags = 0;
+        juce::juce_wchar passwordCharacter = 0;
+    };
+
+    struct StopPosition
+    {
+        int index, logicalLine;
+        float y;
+    };
+
+    //==============================================================================
+    // Runs the iterator, appending a Line for each visual line it produces. If stopAfterIndex
+    // is >= 0, this stops at the first logical line that starts beyond that index, and if
+    // stopBelowY is >= 0, at the first logical line that starts below that position.
+    static bool layOutLines (Iterator& i, int firstLogicalLine, int stopAfterIndex,
+                             juce::Array<Line>& dest, StopPosition& stoppedAt, float stopBelowY = -1.0f)
+    {
+        auto logicalLine = firstLogicalLine - 1;
+        auto nextStartsLogicalLine = true;
+        auto current = -1;
+
+        while (i.next())
+        {
+            if (current < 0 || i.lineY != dest.getReference (current).y)
+            {
+                if (nextStartsLogicalLine)
+                {
+                    if (current >= 0 && ((stopAfterIndex >= 0 && i.indexInText > stopAfterIndex)
+                                           || (stopBelowY >= 0 && i.lineY > stopBelowY)))
+                    {
+                        stoppedAt = { i.indexInText, logicalLine + 1, i.lineY };
+                        return true;
+                    }
+
+                    ++logicalLine;
+                }
+
+                dest.add ({ i.indexInText, 0, logicalLine, i.lineY, i.lineHeight, i.atomX, 0.0f, nextStartsLogicalLine, false, false, {} });
+                current = dest.size() - 1;
+            }
+
+            auto& line = dest.getReference (current);
+            line.numChars = i.indexInText + i.atom->numChars - line.startIndex;
+            line.right = juce::jmax (line.right, i.atomRight);
+            line.clipped = line.clipped || i.atomRight < i.atomX + i.getAtomWidth();
+            logicalLine += i.getNumFoldedNewLines();
+
+            // a line that starts with hidden lines is numbered after them
+            if (i.isHiddenLines() && line.numChars == i.atom->numChars)
+                line.logicalLine = logicalLine;
+            addToSummary (line.summary, i);
+
+            nextStartsLogicalLine = i.atom->isNewLine();
+        }
+
+        // the empty line that follows a trailing new-line (or an empty document)
+        if (current < 0 || nextStartsLogicalLine)
+        {
+            auto endIndex = i.atom != nullptr ? i.indexInText + i.atom->numChars : i.indexInText;
+            dest.add ({ endIndex, 0, logicalLine + 1, i.lineY, i.lineHeight, i.atomX, 0.0f, true, false, false, {} });
+        }
+
+        return false;
+    }
+
+    // A single-line editor's text is always one line (unless new-lines have been put into
+    // it programmatically, or some of it is folded), so it gets laid out here in one pass over
+    // the atoms rather than with the iterator. The atoms' positions go straight into the
+    // geometry cache, so finding the caret position or the index at a point needs no
+    // further layout either.
+    bool layOutSingleLine (const Parameters& newParameters)
+    {
+        if (! owner.foldedRanges.isEmpty() || ! owner.inlays.isEmpty())
+            return false;
+
+        const auto zoom = newParameters.zoomFactor;
+        juce::Array<AtomGeometry> atoms;
+        LineSummary summary;
+        auto width = 0.0f;
+        auto height = owner.sections.isEmpty() ? newParameters.firstLineHeight * zoom : 0.0f;
+        auto numChars = 0;
+
+        for (auto* section : owner.sections)
+        {
+            const auto font = scaleFont (section->font, zoom);
+            height = juce::jmax (height, section->font.getHeight() * zoom);
+
+            for (auto& atom : section->getAtoms())
+            {
+                if (atom.isNewLine())
+                    return false;
+
+                const auto right = width + section->getZoomedAtomWidth (atom, zoom);
+
+                atoms.add ({ numChars, atom.numChars, width, right, false, false,
+                             atom.getText (owner.passwordCharacter), font, {}, {} });
+                addToSummary (summary, atom, atom.numChars, section->colour);
+
+                width = right;
+                numChars += atom.numChars;
+            }
+        }
+
+        const auto left = numChars > 0 ? Iterator::getJustificationOffsetX (owner.justification,
+                                                                            (float) newParameters.maximumTextWidth,
+                                                                            width)
+                                       : 0.0f;
+
+        for (auto& atom : atoms)
+        {
+            atom.x += left;
+            atom.right += left;
+        }
+
+        parameters = newParameters;
+        firstStaleLine = -1;
+
+        lines.clearQuick();
+        lines.add ({ 0, numChars, 0, 0.0f, height,
+                     left, left + width, true, false, false, std::move (summary) });
+        updateTextRight();
+
+        geometryCache.clear();
+        geometryCache.add (new LineGeometry { 0, std::move (atoms) });
+        return true;
+    }
+
+    static void addToSummary (LineSummary& summary, const Iterator& i)
+    {
+        if (! i.atom->isNewLine() && ! i.isInlay() && ! i.isHiddenLines())
+            addToSummary (summary, *i.atom, i.isFoldPlaceholder() ? 1 : i.atom->numChars, i.getColour());
+    }
+
+    static void addToSummary (LineSummary& summary, const TextAtom& atom, int numChars, juce::Colour colour)
+    {
+        if (atom.isWhitespace())
+        {
+            if (summary.runs.isEmpty())
+                summary.indent += numChars;
+        }
+        else
+        {
+            auto* last = summary.runs.isEmpty() ? nullptr : &summary.runs.getReference (summary.runs.size() - 1);
+
+            if (last != nullptr && last->start + last->length == summary.length)
+            {
+                // a piece that's longer than the rest of the run so far takes over its colour
+                if (numChars > last->length)
+                    last->colour = colour;
+
+                last->length += numChars;
+            }
+            else
+            {
+                summary.runs.add ({ summary.length, numChars, colour });
+            }
+        }
+
+        summary.length += numChars;
+    }
+
+    // Only the lines down to a little way below the visible area are laid out; the rest are
+    // estimated, and get laid out later by continueLayout().
+    void rebuild()
+    {
+        lines.clearQuick();
+        firstStaleLine = -1;
+
+        Iterator i (owner);
+        StopPosition stoppedAt;
+
+        if (layOutLines (i, 0, -1, lines, stoppedAt, getLayoutLimit()))
+            addEstimatedLines (stoppedAt);
+
+        updateTextRight();
+    }
+
+    // the position below which lines can be left to be laid out later
+    float getLayoutLimit() const
+    {
+        auto visibleHeight = owner.viewport->getMaximumVisibleHeight();
+        return (float) (owner.viewport->getViewPositionY() + visibleHeight * 2);
+    }
+
+    // Adds a line for each logical line from the given position onwards, without laying any
+    // of them out or measuring any text: each one is assumed to fit on a single visual line.
+    // Only the sections with new-lines in them have their atoms looked at, and compressed ones
+    // are never expanded: the logical lines that end inside one are merged into one estimated
+    // line, which gets split up again when it's laid out.
+    void addEstimatedLines (const StopPosition& start)
+    {
+        const auto& sections = owner.sections;
+        const auto& folds = owner.foldedRanges;
+
+        int index = 0;
+        auto sectionIndex = owner.findSectionContaining (start.index, index);
+
+        auto atomIndex = sectionIndex < sections.size() ? sections.getUnchecked (sectionIndex)->findAtomContaining (start.index - index) : 0;
+        index = start.index;
+
+        auto foldIndex = (int) (std::upper_bound (folds.begin(), folds.end(), index,
+                                                  [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); })
+                                  - folds.begin());
+
+        firstStaleLine = lines.size();
+
+        auto lineStart = index;
+        auto logicalLine = start.logicalLine, numFoldedLines = 0, numMergedLines = 0;
+        auto y = start.y, height = 0.0f;
+
+        auto addLine = [&] (int endIndex)
+        {
+            lines.add ({ lineStart, endIndex - lineStart, logicalLine, y,
+                         height * (1.0f + (float) numMergedLines * parameters.lineSpacing),
+                         0.0f, 0.0f, true, false, true, {} });
+
+            y += height * parameters.lineSpacing * (float) (numMergedLines + 1);
+            logicalLine += numFoldedLines + numMergedLines + 1;
+            numFoldedLines = numMergedLines = 0;
+            lineStart = endIndex;
+        };
+
+        while (sectionIndex < sections.size())
+        {
+            auto* section = sections.getUnchecked (sectionIndex);
+            height = juce::jmax (height, section->font.getHeight() * parameters.zoomFactor);
+
+            if (atomIndex == 0 && foldIndex < folds.size() && folds.getReference (foldIndex).range.getStart() == index)
+            {
+                const auto& fold = folds.getReference (foldIndex++);
+                numFoldedLines += fold.numNewLines;
+
+                while (sectionIndex < sections.size() && index < fold.range.getEnd())
+                    index += sections.getUnchecked (sectionIndex++)->getTotalLength();
+
+                continue;
+            }
+
+            // (the counts are kept while a section is compressed, so this doesn't expand it)
+            if (atomIndex == 0 && (section->getNumNewLines() == 0 || section->isCompressed()))
+            {
+                index += section->getTotalLength();
+                numMergedLines += section->getNumNewLines();
+                ++sectionIndex;
+                continue;
+            }
+
+            for (; atomIndex < section->getAtoms().size(); ++atomIndex)
+            {
+                const auto& atom = section->getAtoms().getReference (atomIndex);
+                index += atom.numChars;
+
+                if (atom.isNewLine())
+                {
+                    addLine (index);
+                    height = section->font.getHeight() * parameters.zoomFactor;
+                }
+            }
+
+            ++sectionIndex;
+            atomIndex = 0;
+        }
+
+        // (if the text ends with a new-line, this is the empty line after it)
+        addLine (index);
+    }
+
+    int indexOfLineContaining (int index) const noexcept
+    {
+        auto upper = std::upper_bound (lines.begin(), lines.end(), index,
+                                       [] (int i, const Line& l) { return i < l.startIndex; });
+
+        return juce::jmax (0, (int) (upper - lines.begin()) - 1);
+    }
+
+    void relayDirtyLines()
+    {
+        auto first = indexOfLineContaining (dirtyStart);
+
+        // the empty line after a trailing new-line can't be resumed from, so use the one before
+        if (first > 0 && first == lines.size() - 1 && lines.getReference (first).numChars == 0)
+            --first;
+
+        while (first > 0 && ! lines.getReference (first).startsLogicalLine)
+            --first;
+
+        const auto& firstLine = lines.getReference (first);
+        Iterator i = first == 0 ? Iterator (owner)
+                                : Iterator (owner, firstLine.startIndex, firstLine.y);
+
+        // An estimated line can hold several logical lines, so if the edit ends inside one, the
+        // layout carries on to the end of it, where there's an old line to pick up from again.
+        auto stopAfterIndex = dirtyEnd;
+        const auto lineAtEnd = indexOfLineContaining (dirtyEnd - dirtyDelta);
+
+        if (lines.getReference (lineAtEnd).estimated)
+            stopAfterIndex = lineAtEnd + 1 < lines.size() ? lines.getReference (lineAtEnd + 1).startIndex + dirtyDelta - 1
+                                                          : -1;
+
+        juce::Array<Line> newLines;
+        StopPosition stoppedAt;
+        const auto oldNumLines = lines.size();
+        auto oldEnd = oldNumLines;
+        auto deltaY = 0.0f;
+        auto deltaLogicalLines = 0;
+
+        if (layOutLines (i, firstLine.logicalLine, stopAfterIndex, newLines, stoppedAt))
+        {
+            // from here on the text is the same as before the edit, so the old lines can be reused
+            oldEnd = indexOfLineContaining (stoppedAt.index - dirtyDelta);
+            const auto& oldLine = lines.getReference (oldEnd);
+
+            if (oldLine.startIndex != stoppedAt.index - dirtyDelta || ! oldLine.startsLogicalLine)
+            {
+                jassertfalse;
+                rebuild();
+                return;
+            }
+
+            deltaY = stoppedAt.y - oldLine.y;
+            deltaLogicalLines = stoppedAt.logicalLine - oldLine.logicalLine;
+        }
+
+        lines.removeRange (first, oldEnd - first);
+        lines.insertArray (first, newLines.begin(), newLines.size());
+
+        for (int n = first + newLines.size(); n < lines.size(); ++n)
+        {
+            auto& line = lines.getReference (n);
+            line.startIndex += dirtyDelta;
+            line.logicalLine += deltaLogicalLines;
+            line.y += deltaY;
+        }
+
+        // while the rest of the layout is pending, the lines that were just laid out are up to date
+        if (firstStaleLine >= oldEnd)
+            firstStaleLine += newLines.size() - (oldEnd - first);
+        else if (firstStaleLine >= first)
+            firstStaleLine = oldEnd < oldNumLines ? first + newLines.size() : -1;
+
+        updateTextRight();
+    }
+
+    // Lays the lines out again after the wrap width has changed. A logical line that fitted on
+    // one visual line, and still fits, keeps its old layout and just moves up or down; only the
+    // others (and any estimated ones) are run through the iterator again. If maxY is >= 0, this
+    // stops at the first logical line below it, and if deadline isn't 0, once the millisecond
+    // counter has passed it. The lines from there on are left as they were until
+    // continueLayout() is called.
+    void rewrap (int firstLine, float maxY, double deadline)
+    {
+        const auto wrapWidth = (float) parameters.wordWrapWidth;
+        auto y = lines.getReference (firstLine).y;
+        firstStaleLine = -1;
+
+        // the lines that replace [firstLine, n) are moved in here, and put back in one go at the end
+        juce::Array<Line> newLines;
+        auto n = firstLine;
+
+        while (n < lines.size())
+        {
+            if ((maxY >= 0 && y > maxY)
+                 || (deadline > 0 && n > firstLine && juce::Time::getMillisecondCounterHiRes() >= deadline))
+            {
+                firstStaleLine = firstLine + newLines.size();
+                break;
+            }
+
+            auto& line = lines.getReference (n);
+            auto end = n + 1;
+
+            while (end < lines.size() && ! lines.getReference (end).startsLogicalLine)
+                ++end;
+
+            if (end == n + 1 && ! line.estimated && ! line.clipped && line.right - 0.0001f < wrapWidth)
+            {
+                line.y = y;
+                y += line.height * parameters.lineSpacing;
+                newLines.add (std::move (line));
+            }
+            else if (! rewrapSimpleLine (n, end, y, newLines))
+            {
+                Iterator i = n == 0 ? Iterator (owner)
+                                    : Iterator (owner, line.startIndex, y);
+
+                // (an estimated line may hold several logical lines, so this stops where the next line starts)
+                const auto stopAfterIndex = end < lines.size() ? lines.getReference (end).startIndex - 1 : -1;
+                StopPosition stoppedAt;
+
+                if (! layOutLines (i, line.logicalLine, stopAfterIndex, newLines, stoppedAt))
+                {
+                    jassert (end == lines.size() || lines.getReference (end).numChars == 0);
+                    n = lines.size();
+                    break;
+                }
+
+                jassert (end < lines.size() && stoppedAt.index == lines.getReference (end).startIndex);
+                y = stoppedAt.y;
+            }
+
+            n = end;
+        }
+
+        const auto deltaY = n < lines.size() ? y - lines.getReference (n).y : 0.0f;
+        const auto numNewLines = newLines.size();
+
+        if (numNewLines != n - firstLine)
+        {
+            lines.removeRange (firstLine, n - firstLine);
+            lines.insertMultiple (firstLine, {}, numNewLines);
+        }
+
+        for (int k = 0; k < numNewLines; ++k)
+            lines.getReference (firstLine + k) = std::move (newLines.getReference (k));
+
+        if (deltaY != 0.0f)
+            for (int k = firstLine + numNewLines; k < lines.size(); ++k)
+                lines.getReference (k).y += deltaY;
+
+        updateTextRight();
+    }
+
+    // Wraps one logical line again from its atoms' stored widths, with a loop over a flat array
+    // of them rather than the iterator. This only works for a line that's simple enough for
+    // the iterator's wrapping to come down to that loop, i.e. all of its text is in one
+    // section, it has no folds or inlays, and none of its words is too long to fit on a line.
+    // Returns false, having added nothing, for any other line.
+    bool rewrapSimpleLine (int lineNum, int nextLogicalLine, float& y, juce::Array<Line>& dest)
+    {
+        const auto& line = lines.getReference (lineNum);
+
+        if (line.estimated || nextLogicalLine >= lines.size())
+            return false;
+
+        const auto start = line.startIndex;
+        const auto end = lines.getReference (nextLogicalLine).startIndex;
+
+        int sectionStart = 0;
+        const auto sectionIndex = owner.findSectionContaining (start, sectionStart);
+
+        if (sectionIndex >= owner.sections.size() || end <= start)
+            return false;
+
+        const auto* section = owner.sections.getUnchecked (sectionIndex);
+
+        if (end > sectionStart + section->getTotalLength())
+            return false;
+
+        const auto fold = std::upper_bound (owner.foldedRanges.begin(), owner.foldedRanges.end(), start,
+                                            [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); });
+
+        if (fold != owner.foldedRanges.end() && fold->range.getStart() <= end)
+            return false;
+
+        const auto inlay = owner.findInlayAtOrAfter (start);
+
+        if (inlay < owner.inlays.size() && owner.getInlayPosition (inlay) <= end)
+            return false;
+
+        const auto& atoms = section->getAtoms();
+        const auto firstAtom = section->findAtomContaining (start - sectionStart);
+        const auto endAtom = section->findAtomContaining (end - 1 - sectionStart) + 1;
+
+        if (section->getAtomStart (firstAtom) != start - sectionStart || ! atoms.getReference (endAtom - 1).isNewLine())
+            return false;
+
+        const auto wrapWidth = (float) parameters.wordWrapWidth;
+        const auto zoom = parameters.zoomFactor;
+        breakWidths.clearQuick();
+
+        for (int k = firstAtom; k < endAtom; ++k)
+        {
+            const auto& atom = atoms.getReference (k);
+            const auto width = section->getZoomedAtomWidth (atom, zoom);
+
+            // (the iterator breaks up a word that's too long for a line)
+            if (! atom.isWhitespace() && width - 0.0001f >= wrapWidth)
+                return false;
+
+            breakWidths.add (width);
+        }
+
+        // the same steps as the iterator's, so the lines come out exactly as it would lay them out
+        const auto height = section->font.getHeight() * zoom;
+        dest.add ({ start, 0, line.logicalLine, y, height, 0.0f, 0.0f, true, false, false, {} });
+        auto* current = &dest.getReference (dest.size() - 1);
+        auto index = start;
+        auto x = 0.0f;
+
+        for (int k = 0; k < breakWidths.size(); ++k)
+        {
+            const auto& atom = atoms.getReference (firstAtom + k);
+            const auto width = breakWidths.getUnchecked (k);
+            auto right = x + width;
+
+            if (right - 0.0001f >= wrapWidth)
+            {
+                if (atom.isWhitespace())
+                {
+                    // whitespace is left at the end of a line, but truncated
+                    right = juce::jmin (right, wrapWidth);
+                }
+                else
+                {
+                    y += height * parameters.lineSpacing;
+                    x = 0.0f;
+                    right = width;
+                    dest.add ({ index, 0, line.logicalLine, y, height, 0.0f, 0.0f, false, false, false, {} });
+                    current = &dest.getReference (dest.size() - 1);
+                }
+            }
+
+            current->numChars = index + atom.numChars - current->startIndex;
+            current->right = juce::jmax (current->right, right);
+            current->clipped = current->clipped || right < x + width;
+
+            if (! atom.isNewLine())
+                addToSummary (current->summary, atom, atom.numChars, section->colour);
+
+            x = right;
+            index += atom.numChars;
+        }
+
+        y += height * parameters.lineSpacing;
+        return true;
+    }
+
+    void updateTextRight() noexcept
+    {
+        textRight = 0;
+
+        for (auto& line : lines)
+            textRight = juce::jmax (textRight, line.right);
+    }
+
+    //==============================================================================
+    const UnicodeTextEditor& owner;
+    juce::Array<Line> lines;
+    juce::Array<float> breakWidths;     // reused by rewrapSimpleLine()
+    Parameters parameters;
+    float textRight = 0;
+
+    bool needsRebuild = true, hasDirtyRange = false;
+    int dirtyStart = 0, dirtyEnd = 0, dirtyDelta = 0;
+    int firstStaleLine = -1;
+
+    struct LineGeometry
+    {
+        int lineNum;
+        juce::Array<AtomGeometry> atoms;
+    };
+
+    static void measureGlyphs (AtomGeometry& atom)
+    {
+        if (atom.glyphLefts.isEmpty())
+        {
+            juce::GlyphArrangement g;
+            g.addLineOfText (atom.font, atom.text, atom.x, 0.0f);
+
+            for (int j = 0; j < g.getNumGlyphs(); ++j)
+            {
+                auto& glyph = g.getGlyph (j);
+                atom.glyphLefts.add (glyph.getLeft());
+                atom.glyphCentres.add ((glyph.getLeft() + glyph.getRight()) / 2);
+            }
+        }
+    }
+
+    // the equivalent of Iterator::indexToX()
+    static float indexToX (AtomGeometry& atom, int index)
+    {
+        if (index <= atom.startIndex)
+            return atom.x;
+
+        if (index >= atom.startIndex + atom.numChars)
+            return atom.right;
+
+        measureGlyphs (atom);
+
+        if (index - atom.startIndex >= atom.glyphLefts.size())
+            return atom.right;
+
+        return juce::jmin (atom.right, atom.glyphLefts.getUnchecked (index - atom.startIndex));
+    }
+
+    static constexpr int maxCachedGeometries = 16;
+    juce::OwnedArray<LineGeometry> geometryCache;
+
+    JUCE_DECLARE_NON_COPYABLE (LineIndex)
+};
+
+//==============================================================================
+// Holds the anchors in two treaps, one for each gravity, ordered by position. Each node
+// stores its position relative to its parent, so an edit only has to change the nodes along
+// the paths where the tree gets split and merged again, however many anchors follow it.
+struct UnicodeTextEditor::AnchorTree
+{
+    AnchorTree() = default;
+
+    int add (int position, AnchorGravity gravity)
+    {
+        auto anchorID = nodes.size();
+
+        if (freeIDs.isEmpty())
+            nodes.add (nullptr);
+        else
+            anchorID = freeIDs.removeAndReturn (freeIDs.size() - 1);
+
+        auto* node = nodes.set (anchorID, new Node());
+        node->delta = position;
+        node->priority = random.nextInt();
+        node->gravity = gravity;
+
+        auto& root = getRoot (gravity);
+        Node* before;
+        Node* after;
+        split (root, 0, [position] (int p) { return p <= position; }, before, after);
+        setRoot (root, merge (merge (before, node), after));
+        return anchorID;
+    }
+
+    void remove (int anchorID)
+    {
+        auto* node = nodes[anchorID];
+
+        if (node == nullptr)
+        {
+            jassertfalse; // this anchor doesn't exist
+            return;
+        }
+
+        // any pending collapses above the node have to be applied before it's unlinked
+        juce::Array<Node*> path;
+
+        for (auto* n = node->parent; n != nullptr; n = n->parent)
+            path.add (n);
+
+        for (int i = path.size(); --i >= 0;)
+            pushDown (path.getUnchecked (i));
+
+        pushDown (node);
+
+        // the children are relative to the node, so they can be merged in its frame
+        auto* replacement = merge (node->left, node->right);
+
+        if (replacement != nullptr)
+        {
+            replacement->delta += node->delta;
+            replacement->parent = node->parent;
+        }
+
+        if (auto* parent = node->parent)
+            (parent->left == node ? parent->left : parent->right) = replacement;
+        else
+            getRoot (node->gravity) = replacement;
+
+        nodes.set (anchorID, nullptr);
+        freeIDs.add (anchorID);
+    }
+
+    int getPosition (int anchorID) const
+    {
+        auto* node = nodes[anchorID];
+
+        if (node == nullptr)
+        {
+            jassertfalse; // this anchor doesn't exist
+            return 0;
+        }
+
+        // a collapse that hasn't been pushed down yet means the node sits at that ancestor's position
+        for (auto* n = node->parent; n != nullptr; n = n->parent)
+            if (n->collapsed)
+                node = n;
+
+        auto position = 0;
+
+        for (auto* n = node; n != nullptr; n = n->parent)
+            position += n->delta;
+
+        return position;
+    }
+
+    void textChanged (int start, int numRemoved, int numInserted)
+    {
+        if (numRemoved > 0)
+        {
+            removeRange (leftRoot, start, numRemoved);
+            removeRange (rightRoot, start, numRemoved);
+        }
+
+        if (numInserted > 0)
+        {
+            shift (leftRoot, [start] (int p) { return p <= start; }, numInserted);
+            shift (rightRoot, [start] (int p) { return p < start; }, numInserted);
+        }
+    }
+
+private:
+    struct Node
+    {
+        int delta = 0;              // relative to the parent, or absolute for a root
+        int priority = 0;
+        bool collapsed = false;     // all the nodes below this one are at the same position
+        AnchorGravity gravity = AnchorGravity::left;
+        Node* left = nullptr;
+        Node* right = nullptr;
+        Node* parent = nullptr;
+    };
+
+    Node*& getRoot (AnchorGravity gravity) noexcept
+    {
+        return gravity == AnchorGravity::left ? leftRoot : rightRoot;
+    }
+
+    static void setRoot (Node*& root, Node* newRoot) noexcept
+    {
+        root = newRoot;
+
+        if (root != nullptr)
+            root->parent = nullptr;
+    }
+
+    static void pushDown (Node* n) noexcept
+    {
+        if (n->collapsed)
+        {
+            for (auto* child : { n->left, n->right })
+            {
+                if (child != nullptr)
+                {
+                    child->delta = 0;
+                    child->collapsed = true;
+                }
+            }
+
+            n->collapsed = false;
+        }
+    }
+
+    static void setChild (Node*& slot, Node* parent, Node* child) noexcept
+    {
+        slot = child;
+
+        if (child != nullptr)
+        {
+            child->delta -= parent->delta;
+            child->parent = parent;
+        }
+    }
+
+    // Splits a tree into the nodes whose positions satisfy goesLeft, and the rest. The base is
+    // the position that the root's delta is relative to; the roots that are returned are absolute.
+    template <typename Predicate>
+    static void split (Node* n, int base, Predicate goesLeft, Node*& before, Node*& after)
+    {
+        if (n == nullptr)
+        {
+            before = after = nullptr;
+            return;
+        }
+
+        pushDown (n);
+        n->delta += base;
+
+        Node* a;
+        Node* b;
+
+        if (goesLeft (n->delta))
+        {
+            split (n->right, n->delta, goesLeft, a, b);
+            setChild (n->right, n, a);
+            before = n;
+            after = b;
+        }
+        else
+        {
+            split (n->left, n->delta, goesLeft, a, b);
+            setChild (n->left, n, b);
+            before = a;
+            after = n;
+        }
+    }
+
+    // Joins two trees whose roots are relative to the same base, where all the nodes in the
+    // first tree come before those in the second.
+    static Node* merge (Node* a, Node* b)
+    {
+        if (a == nullptr)  return b;
+        if (b == nullptr)  return a;
+
+        if (a->priority > b->priority)
+        {
+            pushDown (a);
+
+            if (auto* r = a->right)
+                r->delta += a->delta;
+
+            setChild (a->right, a, merge (a->right, b));
+            return a;
+        }
+
+        pushDown (b);
+
+        if (auto* l = b->left)
+            l->delta += b->delta;
+
+        setChild (b->left, b, merge (a, b->left));
+        return b;
+    }
+
+    template <typename Predicate>
+    static void shift (Node*& root, Predicate staysPut, int delta)
+    {
+        Node* before;
+        Node* after;
+        split (root, 0, staysPut, before, after);
+
+        if (after != nullptr)
+            after->delta += delta;
+
+        setRoot (root, merge (before, after));
+    }
+
+    // anchors inside the removed range end up at its start, and the ones after it move back
+    static void removeRange (Node*& root, int start, int numRemoved)
+    {
+        const auto end = start + numRemoved;
+        Node* before;
+        Node* rest;
+        Node* inside;
+        Node* after;
+
+        split (root, 0, [start] (int p) { return p <= start; }, before, rest);
+        split (rest, 0, [end] (int p) { return p < end; }, inside, after);
+
+        if (inside != nullptr)
+        {
+            inside->delta = start;
+            inside->collapsed = true;
+        }
+
+        if (after != nullptr)
+            after->delta -= numRemoved;
+
+        setRoot (root, merge (merge (before, inside), after));
+    }
+
+    juce::OwnedArray<Node> nodes;
+    juce::Array<int> freeIDs;
+    Node* leftRoot = nullptr;
+    Node* rightRoot = nullptr;
+    juce::Random random;
+
+    JUCE_DECLARE_NON_COPYABLE (AnchorTree)
+};
+
+//==============================================================================
+// Holds the decorations in a treap ordered by their start positions, where each node also
+// knows the furthest end of any decoration below it. As in the AnchorTree, positions are
+// relative to the parent node, so an edit only needs to touch the decorations that span it
+// plus one path down the tree, and finding the ones on screen skips the subtrees that end
+// before the visible text.
+struct UnicodeTextEditor::DecorationTree
+{
+    struct Decoration
+    {
+        juce::Range<int> range;
+        DecorationStyle style;
+        juce::Colour colour;
+    };
+
+    DecorationTree() = default;
+
+    int add (juce::Range<int> range, DecorationStyle style, juce::Colour colour)
+    {
+        auto decorationID = nodes.size();
+
+        if (freeIDs.isEmpty())
+            nodes.add (nullptr);
+        else
+            decorationID = freeIDs.removeAndReturn (freeIDs.size() - 1);
+
+        auto* node = nodes.set (decorationID, new Node());
+        node->delta = range.getStart();
+        node->length = node->maxEnd = range.getLength();
+        node->priority = random.nextInt();
+        node->style = style;
+        node->colour = colour;
+
+        Node* before;
+        Node* after;
+        split (root, 0, [range] (int start) { return start <= range.getStart(); }, before, after);
+        setRoot (merge (merge (before, node), after));
+        return decorationID;
+    }
+
+    void remove (int decorationID)
+    {
+        auto* node = nodes[decorationID];
+
+        if (node == nullptr)
+        {
+            jassertfalse; // this decoration doesn't exist
+            return;
+        }
+
+        // the children are relative to the node, so they can be merged in its frame
+        auto* replacement = merge (node->left, node->right);
+
+        if (replacement != nullptr)
+        {
+            replacement->delta += node->delta;
+            replacement->parent = node->parent;
+        }
+
+        if (auto* parent = node->parent)
+            (parent->left == node ? parent->left : parent->right) = replacement;
+        else
+            root = replacement;
+
+        for (auto* n = node->parent; n != nullptr; n = n->parent)
+            update (n);
+
+        nodes.set (decorationID, nullptr);
+        freeIDs.add (decorationID);
+    }
+
+    void clear()
+    {
+        root = nullptr;
+        nodes.clear();
+        freeIDs.clear();
+    }
+
+    juce::Range<int> getRange (int decorationID) const
+    {
+        auto* node = nodes[decorationID];
+
+        if (node == nullptr)
+        {
+            jassertfalse; // this decoration doesn't exist
+            return {};
+        }
+
+        auto start = 0;
+
+        for (auto* n = node; n != nullptr; n = n->parent)
+            start += n->delta;
+
+        return { start, start + node->length };
+    }
+
+    // adds the non-empty decorations that overlap a range to an array, in order of their starts
+    void findOverlapping (juce::Range<int> range, juce::Array<Decoration>& results) const
+    {
+        findOverlapping (root, 0, range, results);
+    }
+
+    // Text inserted inside a decoration extends it, but text inserted at either end doesn't.
+    // Decorations inside a removed range shrink to nothing at its start.
+    void textChanged (int start, int numRemoved, int numInserted)
+    {
+        if (numRemoved > 0)
+        {
+            const auto end = start + numRemoved;
+            Node* before;
+            Node* rest;
+            Node* inside;
+            Node* after;
+
+            split (root, 0, [start] (int s) { return s <= start; }, before, rest);
+            split (rest, 0, [end] (int s) { return s < end; }, inside, after);
+
+            trimEnds (before, 0, start, end);
+
+            if (inside != nullptr)
+            {
+                moveToStart (inside, 0, end);
+                inside->delta = start;
+            }
+
+            if (after != nullptr)
+                after->delta -= numRemoved;
+
+            setRoot (merge (merge (before, inside), after));
+        }
+
+        if (numInserted > 0)
+        {
+            extendSpanning (root, 0, start, numInserted);
+
+            Node* before;
+            Node* after;
+            split (root, 0, [start] (int s) { return s < start; }, before, after);
+
+            if (after != nullptr)
+                after->delta += numInserted;
+
+            setRoot (merge (before, after));
+        }
+    }
+
+    // draws the line for an underline, squiggle or strike-through over one line's part of the text
+    static void drawLine (juce::Graphics& g, const Decoration& decoration, juce::Rectangle<float> area, juce::AffineTransform transform)
+    {
+        juce::Graphics::ScopedSaveState state (g);
+        g.addTransform (transform);
+        g.setColour (decoration.colour);
+
+        if (decoration.style == DecorationStyle::squiggle)
+        {
+            const auto bottom = area.getBottom() - 1.0f, top = bottom - 2.0f, step = 2.0f;
+            auto up = true;
+
+            juce::Path wave;
+            wave.startNewSubPath (area.getX(), bottom);
+
+            for (auto x = area.getX() + step; x < area.getRight() + step; x += step, up = ! up)
+                wave.lineTo (juce::jmin (x, area.getRight()), up ? top : bottom);
+
+            g.strokePath (wave, juce::PathStrokeType (1.0f));
+        }
+        else
+        {
+            const auto y = decoration.style == DecorationStyle::strikeThrough ? area.getCentreY()
+                                                                              : area.getBottom() - 1.0f;
+            g.fillRect (area.withY (y).withHeight (1.0f));
+        }
+    }
+
+private:
+    struct Node
+    {
+        int delta = 0;              // the start, relative to the parent or absolute for the root
+        int length = 0;
+        int maxEnd = 0;             // the furthest end in this subtree, relative to this start
+        int priority = 0;
+        DecorationStyle style = DecorationStyle::background;
+        juce::Colour colour;
+        Node* left = nullptr;
+        Node* right = nullptr;
+        Node* parent = nullptr;
+    };
+
+    void setRoot (Node* newRoot) noexcept
+    {
+        root = newRoot;
+
+        if (root != nullptr)
+            root->parent = nullptr;
+    }
+
+    static void update (Node* n) noexcept
+    {
+        n->maxEnd = n->length;
+
+        for (auto* child : { n->left, n->right })
+            if (child != nullptr)
+                n->maxEnd = juce::jmax (n->maxEnd, child->delta + child->maxEnd);
+    }
+
+    static void setChild (Node*& slot, Node* parent, Node* child) noexcept
+    {
+        slot = child;
+
+        if (child != nullptr)
+        {
+            child->delta -= parent->delta;
+            child->parent = parent;
+        }
+
+        update (parent);
+    }
+
+    // These work in the same way as the ones in AnchorTree.
+    template <typename Predicate>
+    static void split (Node* n, int base, Predicate goesLeft, Node*& before, Node*& after)
+    {
+        if (n == nullptr)
+        {
+            before = after = nullptr;
+            return;
+        }
+
+        n->delta += base;
+
+        Node* a;
+        Node* b;
+
+        if (goesLeft (n->delta))
+        {
+            split (n->right, n->delta, goesLeft, a, b);
+            setChild (n->right, n, a);
+            before = n;
+            after = b;
+        }
+        else
+        {
+            split (n->left, n->delta, goesLeft, a, b);
+            setChild (n->left, n, b);
+            before = a;
+            after = n;
+        }
+    }
+
+    static Node* merge (Node* a, Node* b)
+    {
+        if (a == nullptr)  return b;
+        if (b == nullptr)  return a;
+
+        if (a->priority > b->priority)
+        {
+            if (auto* r = a->right)
+                r->delta += a->delta;
+
+            setChild (a->right, a, merge (a->right, b));
+            return a;
+        }
+
+        if (auto* l = b->left)
+            l->delta += b->delta;
+
+        setChild (b->left, b, merge (a, b->left));
+        return b;
+    }
+
+    static void findOverlapping (const Node* n, int base, juce::Range<int> range, juce::Array<Decoration>& results)
+    {
+        if (n == nullptr)
+            return;
+
+        const auto start = base + n->delta;
+
+        if (start + n->maxEnd <= range.getStart())
+            return;
+
+        findOverlapping (n->left, start, range, results);
+
+        if (start < range.getEnd())
+        {
+            if (n->length > 0 && start + n->length > range.getStart())
+                results.add ({ { start, start + n->length }, n->style, n->colour });
+
+            findOverlapping (n->right, start, range, results);
+        }
+    }
+
+    // lengthens the decorations that start before the index and end after it
+    static void extendSpanning (Node* n, int base, int index, int numInserted)
+    {
+        if (n == nullptr)
+            return;
+
+        const auto start = base + n->delta;
+
+        if (start + n->maxEnd <= index)
+            return;
+
+        extendSpanning (n->left, start, index, numInserted);
+
+        if (start < index)
+        {
+            if (start + n->length > index)
+                n->length += numInserted;
+
+            extendSpanning (n->right, start, index, numInserted);
+        }
+
+        update (n);
+    }
+
+    // cuts off the parts of these decorations (which all start at or before the removed range) that it covered
+    static void trimEnds (Node* n, int base, int removedStart, int removedEnd)
+    {
+        if (n == nullptr)
+            return;
+
+        const auto start = base + n->delta;
+
+        if (start + n->maxEnd <= removedStart)
+            return;
+
+        trimEnds (n->left, start, removedStart, removedEnd);
+        trimEnds (n->right, start, removedStart, removedEnd);
+
+        const auto end = start + n->length;
+
+        if (end > removedStart)
+            n->length = (end <= removedEnd ? removedStart : end - (removedEnd - removedStart)) - start;
+
+        update (n);
+    }
+
+    // moves these decorations (which all start inside the removed range) to its start; the
+    // caller then sets the root's position
+    static void moveToStart (Node* n, int base, int removedEnd)
+    {
+        if (n == nullptr)
+            return;
+
+        const auto start = base + n->delta;
+
+        moveToStart (n->left, start, removedEnd);
+        moveToStart (n->right, start, removedEnd);
+
+        n->length = juce::jmax (0, start + n->length - removedEnd);
+        n->delta = 0;
+        update (n);
+    }
+
+    juce::OwnedArray<Node> nodes;
+    juce::Array<int> freeIDs;
+    Node* root = nullptr;
+    juce::Random random;
+
+    JUCE_DECLARE_NON_COPYABLE (DecorationTree)
+};
+
+//==============================================================================
+// Tests each line of the text against a predicate on a background thread, and hides the
+// lines that don't match with folds that have no placeholder. An edit only has the lines from
+// the start of the one it's in onwards tested again, and an append only the appended text
+// and the line it was added to, so the hidden ranges before that are kept.
+struct UnicodeTextEditor::LineFilter  : private juce::Thread
+{
+    LineFilter (UnicodeTextEditor& ed, std::function<bool (const juce::String&)> predicateToUse)
+        : juce::Thread ("UnicodeTextEditor line filter"),
+          owner (ed),
+          predicate (std::move (predicateToUse))
+    {
+        startThread (juce::Thread::Priority::background);
+        testFrom (0);
+    }
+
+    ~LineFilter() override
+    {
+        stopThread (2000);
+    }
+
+    // The start is where the text stopped being the same, which is before the edit if it
+    // touched a hidden range, as the whole of that range will have been shown again.
+    void textChanged (int start, int numRemoved, int numInserted)
+    {
+        const auto lineStart = findLineStart (start);
+
+        if (owner.batchingEdits)
+        {
+            batchStart = batchStart < 0 ? lineStart : juce::jmin (batchStart, lineStart);
+            return;
+        }
+
+        const auto isAppend = numRemoved == 0 && start + numInserted == owner.getTotalNumChars();
+
+        // the jobs that are already queued cover text that an append hasn't changed, so they
+        // can carry on, and only the line that was added to and the new text need testing
+        if (isAppend)
+            queueJob (lineStart);
+        else
+            testFrom (lineStart);
+    }
+
+    // Called after a batch of edits, which the filter was told about without testing anything.
+    void restart()
+    {
+        if (batchStart >= 0)
+            testFrom (batchStart);
+
+        batchStart = -1;
+    }
+
+    // Called when the filter's document is put back into the editor. Any results that came
+    // back while it was out were dropped, so the text they covered has to be tested again.
+    void resume()
+    {
+        testFrom (testedUpTo);
+    }
+
+private:
+    struct Job
+    {
+        int generation = 0, start = 0;
+        juce::String text;
+    };
+
+    // Results are only used if the text before the point where they start hasn't changed
+    // since, so anything other than an append starts a new generation, and the jobs queued
+    // for the old one are dropped. The text that those jobs would have tested is tested by
+    // the new one instead.
+    void testFrom (int start)
+    {
+        if (numOutstanding > 0)
+            start = juce::jmin (start, untestedFrom);
+
+        generation = getNextGeneration();
+        numOutstanding = 0;
+        testedUpTo = juce::jmin (testedUpTo, start);
+
+        {
+            const juce::ScopedLock sl (lock);
+            pendingJobs.clear();
+        }
+
+        queueJob (start);
+    }
+
+    void queueJob (int start)
+    {
+        untestedFrom = numOutstanding > 0 ? juce::jmin (untestedFrom, start) : start;
+        ++numOutstanding;
+
+        Job job { generation, start, owner.getTextInRange ({ start, owner.getTotalNumChars() }) };
+
+        {
+            const juce::ScopedLock sl (lock);
+            pendingJobs.add (std::move (job));
+        }
+
+        notify();
+    }
+
+    // returns the start of the line containing an index, looking back through the sections
+    // only as far as the new-line before it
+    int findLineStart (int index) const
+    {
+        return juce::jmax (0, owner.findEndOfLastNewLine ({ 0, index }));
+    }
+
+    static int getNextGeneration() noexcept
+    {
+        static int lastGeneration = 0;
+        return ++lastGeneration;
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            Job job;
+
+            {
+                const juce::ScopedLock sl (lock);
+
+                if (! pendingJobs.isEmpty())
+                    job = pendingJobs.removeAndReturn (0);
+            }
+
+            if (job.generation == 0)
+            {
+                wait (-1);
+                continue;
+            }
+
+            juce::Array<FoldedRange> hidden;
+            int lastLineStart = 0;
+
+            if (! testLines (job, hidden, lastLineStart))
+                continue;
+
+            // (the results arrive in the order the jobs were queued, so a later job's results
+            // replace the earlier ones' from where it starts)
+            juce::MessageManager::callAsync ([safeOwner = juce::Component::SafePointer<UnicodeTextEditor> (&owner),
+                                              filter = this, resultGeneration = job.generation, start = job.start,
+                                              hidden, lastLineStart]
+            {
+                if (safeOwner != nullptr && safeOwner->lineFilter.get() == filter
+                     && filter->generation == resultGeneration)
+                {
+                    filter->testedUpTo = lastLineStart;
+
+                    if (--(filter->numOutstanding) == 0)
+                        filter->untestedFrom = -1;
+
+                    safeOwner->replaceHiddenRanges (start, hidden);
+                }
+            });
+        }
+    }
+
+    // Finds the ranges to hide, each one made of whole lines including their new-lines. The
+    // last line is also tested, but it'll be tested again when more text is added to it.
+    bool testLines (const Job& job, juce::Array<FoldedRange>& hidden, int& lastLineStart) const
+    {
+        auto p = job.text.getCharPointer();
+        auto lineStart = job.start;
+
+        for (;;)
+        {
+            if (threadShouldExit())
+                return false;
+
+            auto lineEnd = p;
+            int length = 0;
+
+            while (! lineEnd.isEmpty() && *lineEnd != '\r' && *lineEnd != '\n')
+            {
+                ++lineEnd;
+                ++length;
+            }
+
+            const juce::String line (p, lineEnd);
+            int newLineLength = 0;
+            p = lineEnd;
+
+            if (*p == '\r')  { ++p; ++newLineLength; }
+            if (*p == '\n')  { ++p; ++newLineLength; }
+
+            const auto nextLineStart = lineStart + length + newLineLength;
+
+            if (nextLineStart > lineStart && ! predicate (line))
+            {
+                const auto numNewLines = newLineLength > 0 ? 1 : 0;
+                auto* last = hidden.isEmpty() ? nullptr : &hidden.getReference (hidden.size() - 1);
+
+                if (last != nullptr && last->range.getEnd() == lineStart)
+                {
+                    last->range.setEnd (nextLineStart);
+                    last->numNewLines += numNewLines;
+                }
+                else
+                {
+                    hidden.add ({ { lineStart, nextLineStart }, numNewLines, true });
+                }
+            }
+
+            if (newLineLength == 0)
+            {
+                lastLineStart = lineStart;
+                return true;
+            }
+
+            lineStart = nextLineStart;
+        }
+    }
+
+    UnicodeTextEditor& owner;
+    const std::function<bool (const juce::String&)> predicate;
+    // (these are only used on the message thread)
+    int generation = 0, testedUpTo = 0, batchStart = -1;
+    int numOutstanding = 0, untestedFrom = -1;      // the jobs whose results haven't been applied yet
+
+    juce::CriticalSection lock;
+    juce::Array<Job> pendingJobs;
+
+    JUCE_DECLARE_NON_COPYABLE (LineFilter)
+};
+
+
+//==============================================================================
+// Copies a big selection to the clipboard a slice at a time, so that the editor stays
+// responsive. The selected sections are copied when it starts, which only shares their
+// atoms' strings (or copies the compressed data), so the text can be edited while it's
+// running. It goes from those straight into a buffer of the right size.
+struct UnicodeTextEditor::ClipboardWriter  : private juce::Timer
+{
+    ClipboardWriter (UnicodeTextEditor& ed, juce::Range<int> rangeToCopy)
+        : owner (ed)
+    {
+        int firstSectionStart = 0;
+
+        for (int i = owner.findSectionContaining (rangeToCopy.getStart(), firstSectionStart), index = firstSectionStart;
+             i < owner.sections.size() && index < rangeToCopy.getEnd(); ++i)
+        {
+            auto* s = owner.sections.getUnchecked (i);
+            auto* copy = sections.add (new UniformTextSection (*s));
+            copy->setClock (nullptr);   // (expanding a copy doesn't give the editor anything to compress)
+            index += s->getTotalLength();
+        }
+
+        // (the range is kept relative to the first of the copied sections)
+        range = rangeToCopy - firstSectionStart;
+        nextIndex = range.getStart();
+
+        text.preallocate ((size_t) owner.getNumBytesAsUTF8 (rangeToCopy));
+        startTimer (intervalMs);
+    }
+
+    static constexpr int minLengthToDefer = 1 << 22;
+
+private:
+    void timerCallback() override
+    {
+        const auto deadline = juce::Time::getMillisecondCounterHiRes() + sliceMs;
+
+        // (each slice carries on from the section that the last one stopped in)
+        for (; sectionIndex < sections.size(); ++sectionIndex)
+        {
+            auto* s = sections.getUnchecked (sectionIndex);
+            const auto sectionEnd = sectionStart + s->getTotalLength();
+
+            // a big section is copied in chunks, so that the deadline can be checked in between
+            while (nextIndex < juce::jmin (sectionEnd, range.getEnd())
+                    && juce::Time::getMillisecondCounterHiRes() < deadline)
+            {
+                const auto chunkEnd = juce::jmin (sectionEnd, range.getEnd(), nextIndex + chunkLength);
+                s->appendSubstring (text, juce::Range<int> (nextIndex, chunkEnd) - sectionStart);
+                nextIndex = chunkEnd;
+            }
+
+            if (nextIndex < sectionEnd)
+                break;
+
+            sections.set (sectionIndex, nullptr);   // (a section that's been copied can be freed)
+            sectionStart = sectionEnd;
+        }
+
+        auto& ed = owner;
+
+        if (nextIndex < range.getEnd())
+        {
+            if (ed.onCopyProgress != nullptr)
+                ed.onCopyProgress ((double) (nextIndex - range.getStart()) / (double) range.getLength());
+
+            return;
+        }
+
+        juce::SystemClipboard::copyTextToClipboard (text.toUTF8());
+        ed.clipboardWriter.reset();   // (this deletes the writer, so mustn't use any members after it)
+
+        if (ed.onCopyProgress != nullptr)
+            ed.onCopyProgress (1.0);
+    }
+
+    static constexpr int chunkLength = 1 << 16, intervalMs = 1;
+    static constexpr double sliceMs = 8.0;
+
+    UnicodeTextEditor& owner;
+    juce::OwnedArray<UniformTextSection> sections;
+    juce::Range<int> range;
+    int nextIndex = 0, sectionIndex = 0, sectionStart = 0;
+    juce::MemoryOutputStream text;
+
+    JUCE_DECLARE_NON_COPYABLE (ClipboardWriter)
+};
+
+//==============================================================================
+// Keeps the inserted text as already-parsed sections. Like the removed sections in a
+// RemoveAction, they're moved in and out of the editor rather than copied, so they're only
+// held here while the insert is undone.
+struct UnicodeTextEditor::InsertAction  : public juce::UndoableAction
+{
+    InsertAction (UnicodeTextEditor& ed, std::unique_ptr<UniformTextSection> newSection,
+                  int insertPos, int oldCaret, int newCaret)
+        : owner (ed),
+          insertIndex (insertPos),
+          length (newSection->getTotalLength()),
+          oldCaretPos (oldCaret),
+          newCaretPos (newCaret)
+    {
+        sections.add (std::move (newSection));
+    }
+
+    bool perform() override
+    {
+        owner.repaintText ({ insertIndex, owner.getTotalNumChars() });
+
+        owner.reinsert (insertIndex, sections);
+
+        owner.checkLayout();
+        owner.moveCaretTo (newCaretPos, false);
+
+        owner.repaintText ({ insertIndex, owner.getTotalNumChars() });
+        return true;
+    }
+
+    bool undo() override
+    {
+        owner.remove ({ insertIndex, insertIndex + length }, nullptr, oldCaretPos, &sections);
+        return true;
+    }
+
+    int getSizeInUnits() override
+    {
+        return length + 16;
+    }
+
+private:
+    UnicodeTextEditor& owner;
+    juce::OwnedArray<UniformTextSection> sections;
+    const int insertIndex, length, oldCaretPos, newCaretPos;
+
+    JUCE_DECLARE_NON_COPYABLE (InsertAction)
+};
+
+//==============================================================================
+struct UnicodeTextEditor::RemoveAction  : public juce::UndoableAction
+{
+    RemoveAction (UnicodeTextEditor& ed, juce::Range<int> rangeToRemove, int oldCaret, int newCaret)
+        : owner (ed),
+          range (rangeToRemove),
+          oldCaretPos (oldCaret),
+          newCaretPos (newCaret)
+    {
+    }
+
+    // The removed sections are moved in and out of the editor rather than copied, so they're
+    // only held here while the removal is in effect.
+    bool perform() override
+    {
+        owner.remove (range, nullptr, newCaretPos, &removedSections);
+        return true;
+    }
+
+    bool undo() override
+    {
+        owner.reinsert (range.getStart(), removedSections);
+        owner.moveCaretTo (oldCaretPos, false);
+        return true;
+    }
+
+    int getSizeInUnits() override
+    {
+        return range.getLength() + 16;
+    }
+
+private:
+    UnicodeTextEditor& owner;
+    const juce::Range<int> range;
+    const int oldCaretPos, newCaretPos;
+    juce::OwnedArray<UniformTextSection> removedSections;
+
+    JUCE_DECLARE_NON_COPYABLE (RemoveAction)
+};
+
+//==============================================================================
+// Replaces several ranges with the same text in one go, as happens when typing with more
+// than one caret. The text is laid out once per keystroke, however many carets there are.
+struct UnicodeTextEditor::MultiReplaceAction  : public juce::UndoableAction
+{
+    MultiReplaceAction (UnicodeTextEditor& ed, const juce::Array<juce::Range<int>>& rangesToReplace,
+                        std::unique_ptr<UniformTextSection> newSection, int oldCaret, int newCaret)
+        : owner (ed),
+          ranges (rangesToReplace),
+          section (std::move (newSection)),
+          oldCaretPos (oldCaret),
+          newCaretPos (newCaret)
+    {
+    }
+
+    bool perform() override
+    {
+        owner.replaceRanges (ranges, *section, removedSections, newCaretPos);
+        return true;
+    }
+
+    bool undo() override
+    {
+        owner.restoreRanges (ranges, section->getTotalLength(), removedSections, oldCaretPos);
+        return true;
+    }
+
+    int getSizeInUnits() override
+    {
+        auto size = section->getTotalLength() * ranges.size() + 16;
+
+        for (auto& range : ranges)
+            size += range.getLength();
+
+        return size;
+    }
+
+private:
+    UnicodeTextEditor& owner;
+    const juce::Array<juce::Range<int>> ranges;
+    const std::unique_ptr<UniformTextSection> section;
+    const int oldCaretPos, newCaretPos;
+    juce::OwnedArray<juce::OwnedArray<UniformTextSection>> removedSections;
+
+    JUCE_DECLARE_NON_COPYABLE (MultiReplaceAction)
+};
+
+//==============================================================================
+// Everything that saveState() takes out of the editor. The editor swaps its own parts with
+// these, so a new Contents starts off holding an empty document.
+struct UnicodeTextEditor::DocumentState::Contents
+{
+    explicit Contents (UnicodeTextEditor& ed)
+        : owner (&ed),
+          lineIndex (new LineIndex (ed)),
+          anchors (new AnchorTree()),
+          decorations (new DecorationTree()),
+          undoManager (new juce::UndoManager())
+    {
+    }
+
+    const UnicodeTextEditor* owner;
+    juce::OwnedArray<UniformTextSection> sections;
+    std::unique_ptr<LineIndex> lineIndex;
+    std::unique_ptr<AnchorTree> anchors;
+    std::unique_ptr<DecorationTree> decorations;
+    std::unique_ptr<LineFilter> lineFilter;
+    std::unique_ptr<juce::UndoManager> undoManager;
+    juce::Array<FoldedRange> foldedRanges;
+    juce::Array<Inlay> inlays;
+    juce::Array<ExtraSelection> extraSelections;        // (their anchors are in the anchor tree above)
+    juce::Array<juce::Range<int>> underlinedSections;
+    juce::Range<int> selection;
+    int caretPosition = 0;
+    int wordCount = 0, newLineCount = 0;
+    juce::Point<int> viewPosition;
+
+    JUCE_DECLARE_NON_COPYABLE (Contents)
+};
+
+UnicodeTextEditor::DocumentState::DocumentState() noexcept = default;
+UnicodeTextEditor::DocumentState::~DocumentState() = default;
+UnicodeTextEditor::DocumentState::DocumentState (DocumentState&&) noexcept = default;
+UnicodeTextEditor::DocumentState& UnicodeTextEditor::DocumentState::operator= (DocumentState&&) noexcept = default;
+
+UnicodeTextEditor::DocumentState::DocumentState (std::unique_ptr<Contents> c) noexcept
+    : contents (std::move (c))
+{
+}
+
+//==============================================================================
+struct UnicodeTextEditor::TextHolderComponent  : public juce::Component,
+public juce::Timer,
+                                          public juce::Value::Listener
+{
+    TextHolderComponent (UnicodeTextEditor& ed)  : owner (ed)
+    {
+        setWantsKeyboardFocus (false);
+        setInterceptsMouseClicks (false, true);
+        setMouseCursor (juce::MouseCursor::ParentCursor);
+
+        owner.getTextValue().addListener (this);
+    }
+
+    ~TextHolderComponent() override
+    {
+        owner.getTextValue().removeListener (this);
+    }
+
+    void paint (juce::Graphics& g) override
+    {
+        owner.drawContent (g);
+    }
+
+    void restartTimer()
+    {
+        startTimer (350);
+    }
+
+    void timerCallback() override
+    {
+        owner.timerCallbackInt();
+    }
+
+    void valueChanged (juce::Value&) override
+    {
+        owner.textWasChangedByValue();
+    }
+
+    UnicodeTextEditor& owner;
+
+private:
+    std::unique_ptr<juce::AccessibilityHandler> createAccessibilityHandler() override
+    {
+        return createIgnoredAccessibilityHandler (*this);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (TextHolderComponent)
+};
+
+//==============================================================================
+// Finishes the layout work that gets put off while the wrap width or zoom factor is changing,
+// and lays out the parts of the text that haven't been needed yet while the editor is idle.
+struct UnicodeTextEditor::LayoutTimer  : public juce::Timer
+{
+    LayoutTimer (UnicodeTextEditor& ed)  : owner (ed) {}
+
+    void timerCallback() override
+    {
+        if (owner.atomWidthsNeedRefining || owner.lineIndex->isLayoutPending())
+        {
+            if (owner.atomWidthsNeedRefining)
+            {
+                owner.refineVisibleAtomWidths();
+                owner.textHolder->repaint();
+            }
+
+            // the rest of the layout is done in small slices, so that the editor stays responsive
+            owner.lineIndex->continueLayout (juce::Time::getMillisecondCounterHiRes() + sliceMs);
+            owner.checkLayout();
+            owner.updateCaretPosition();
+        }
+
+        // (this only puts text into cold storage once the layout has finished with it)
+        owner.compressColdSections();
+
+        if (owner.lineIndex->isLayoutPending())
+            startTimer (idleIntervalMs);
+        else
+            stopTimer();
+    }
+
+    static constexpr int delayMs = 250, idleIntervalMs = 20;
+    static constexpr double sliceMs = 4.0;
+
+private:
+    UnicodeTextEditor& owner;
+
+    JUCE_DECLARE_NON_COPYABLE (LayoutTimer)
+};
+
+//==============================================================================
+namespace TextEditorDefs
+{
+    const int textChangeMessageId = 0x10003001;
+    const int returnKeyMessageId  = 0x10003002;
+    const int escapeKeyMessageId  = 0x10003003;
+    const int focusLossMessageId  = 0x10003004;
+
+    const int maxActionsPerTransaction = 100;
+    const int coldStorageChunkLength = 16384;
+
+    // a layout cache file has this, then the number of atoms, then a float for each atom's width;
+    // the last character is the format version, which is also part of the file's name
+    const int layoutCacheMagic = 0x32434c55;    // "ULC2"
+    const int layoutCacheHeaderSize = 8;
+
+    static int getCharacterCategory (juce::juce_wchar character) noexcept
+    {
+        return juce::CharacterFunctions::isLetterOrDigit (character)
+                    ? 2 : (juce::CharacterFunctions::isWhitespace (character) ? 0 : 1);
+    }
+
+    static juce::Colour findColourOrDefault (const juce::Component& c, int colourId, juce::Colour defaultColour)
+    {
+        return c.isColourSpecified (colourId) || c.getLookAndFeel().isColourSpecified (colourId)
+                 ? c.findColour (colourId) : defaultColour;
+    }
+}
+
+//==============================================================================
+struct UnicodeTextEditor::LineNumberGutter  : public juce::Component
+{
+    LineNumberGutter (UnicodeTextEditor& ed)  : owner (ed)
+    {
+        setInterceptsMouseClicks (false, false);
+    }
+
+    int getRequiredWidth() const
+    {
+        auto numDigits = juce::jmax (2, juce::String (owner.lineIndex->getNumLogicalLines()).length());
+
+        return juce::roundToInt ((float) numDigits * getFont().getStringWidthFloat ("0")) + padding * 2;
+    }
+
+    void paint (juce::Graphics& g) override
+    {
+        g.fillAll (TextEditorDefs::findColourOrDefault (owner, lineNumberBackgroundColourId, juce::Colours::transparentBlack));
+
+        auto& index = *owner.lineIndex;
+        auto top = (float) owner.topIndent + index.getYOffset() - (float) owner.viewport->getViewPositionY();
+        auto clip = g.getClipBounds();
+
+        g.setFont (getFont());
+        g.setColour (TextEditorDefs::findColourOrDefault (owner, lineNumberTextColourId,
+                                                          owner.findColour (textColourId).withMultipliedAlpha (0.5f)));
+
+        for (int i = index.findLineAtY ((float) clip.getY() - top), numLines = index.getNumLines(); i < numLines; ++i)
+        {
+            auto& line = index.getLine (i);
+            auto y = top + line.y;
+
+            if (y >= (float) clip.getBottom())
+                break;
+
+            if (line.startsLogicalLine)
+                g.drawText (juce::String (line.logicalLine + 1),
+                            juce::Rectangle<float> (0.0f, y, (float) (getWidth() - padding), line.height),
+                            juce::Justification::bottomRight, false);
+        }
+    }
+
+private:
+    UnicodeTextEditor& owner;
+    static constexpr int padding = 4;
+
+    juce::Font getFont() const
+    {
+        return scaleFont (owner.currentFont, owner.zoomFactor);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (LineNumberGutter)
+};
 
 //==============================================================================
-namespace TextEditorDefs
+struct UnicodeTextEditor::TextEditorViewport  : public juce::Viewport
 {
-    const int textChangeMessageId = 0x10003001;
-    const int returnKeyMessageId  = 0x10003002;
-    const int escapeKeyMessageId  = 0x10003003;
-    const int focusLossMessageId  = 0x10003004;
+    TextEditorViewport (UnicodeTextEditor& ed) : owner (ed) {}
 
-    const int maxActionsPerTransaction = 100;
+    void visibleAreaChanged (const juce::Rectangle<int>& newVisibleArea) override
+    {
+        // scrolling into text that hasn't been laid out yet needs it laying out straight away
+        if (owner.lineIndex->layOutDownTo ((float) (newVisibleArea.getBottom() - owner.topIndent)))
+        {
+            owner.checkLayout();
+            owner.textHolder->repaint();
+        }
 
-    static int getCharacterCategory (juce::juce_wchar character) noexcept
+        if (owner.lineNumberGutter != nullptr)
+            owner.lineNumberGutter->repaint();
+
+        for (auto* minimap : owner.minimaps)
+            minimap->repaint();
+
+        if (! reentrant) // it's rare, but possible to get into a feedback loop as the viewport's scrollbars
+                         // appear and disappear, causing the wrap width to change.
+        {
+            auto wordWrapWidth = owner.getWordWrapWidth();
+
+            if (wordWrapWidth != lastWordWrapWidth)
+            {
+                lastWordWrapWidth = wordWrapWidth;
+
+                juce::ScopedValueSetter<bool> svs (reentrant, true);
+                owner.checkLayout();
+            }
+        }
+    }
+
+private:
+    std::unique_ptr<juce::AccessibilityHandler> createAccessibilityHandler() override
     {
-        return juce::CharacterFunctions::isLetterOrDigit (character)
-                    ? 2 : (juce::CharacterFunctions::isWhitespace (character) ? 0 : 1);
+        return createIgnoredAccessibilityHandler (*this);
     }
-}
+
+    UnicodeTextEditor& owner;
+    int lastWordWrapWidth = 0;
+    bool reentrant = false;
+
+    JUCE_DECLARE_NON_COPYABLE (TextEditorViewport)
+};
 
 //==============================================================================
 UnicodeTextEditor::UnicodeTextEditor (const juce::String& name, juce::juce_wchar passwordChar)
@@ -922,6 +3862,11 @@ UnicodeTextEditor::UnicodeTextEditor (const juce::String& name, juce::juce_wchar
 {
     setMouseCursor (juce::MouseCursor::IBeamCursor);
 
+    lineIndex.reset (new LineIndex (*this));
+    anchors.reset (new AnchorTree());
+    decorations.reset (new DecorationTree());
+    layoutTimer.reset (new LayoutTimer (*this));
+
     viewport.reset (new TextEditorViewport (*this));
     addAndMakeVisible (viewport.get());
     viewport->setViewedComponent (textHolder = new TextHolderComponent (*this));
@@ -936,11 +3881,14 @@ UnicodeTextEditor::UnicodeTextEditor (const juce::String& name, juce::juce_wchar
 
 UnicodeTextEditor::~UnicodeTextEditor()
 {
+    lineFilter.reset();
     juce::Desktop::getInstance().removeGlobalMouseListener (this);
 
     textValue.removeListener (textHolder);
     textValue.referTo (juce::Value());
 
+    layoutTimer.reset();
+    lineNumberGutter.reset();
     viewport.reset();
     textHolder = nullptr;
 }
@@ -949,7 +3897,7 @@ UnicodeTextEditor::~UnicodeTextEditor()
 void UnicodeTextEditor::newTransaction()
 {
     lastTransactionTime = juce::Time::getApproximateMillisecondCounter();
-    undoManager.beginNewTransaction();
+    undoManager->beginNewTransaction();
 }
 
 bool UnicodeTextEditor::undoOrRedo (const bool shouldUndo)
@@ -958,8 +3906,8 @@ bool UnicodeTextEditor::undoOrRedo (const bool shouldUndo)
     {
         newTransaction();
 
-        if (shouldUndo ? undoManager.undo()
-                       : undoManager.redo())
+        if (shouldUndo ? undoManager->undo()
+                       : undoManager->redo())
         {
             repaint();
             textChanged();
@@ -998,6 +3946,15 @@ bool UnicodeTextEditor::isMultiLine() const
     return multiline;
 }
 
+void UnicodeTextEditor::setDeferredRewrapEnabled (bool shouldDeferRewrap)
+{
+    if (deferredRewrap != shouldDeferRewrap)
+    {
+        deferredRewrap = shouldDeferRewrap;
+        checkLayout();
+    }
+}
+
 void UnicodeTextEditor::setScrollbarsShown (bool shown)
 {
     if (scrollbarVisible != shown)
@@ -1007,6 +3964,27 @@ void UnicodeTextEditor::setScrollbarsShown (bool shown)
     }
 }
 
+void UnicodeTextEditor::setLineNumbersShown (bool shouldBeShown)
+{
+    if (lineNumbersShown != shouldBeShown)
+    {
+        lineNumbersShown = shouldBeShown;
+
+        if (shouldBeShown)
+        {
+            lineNumberGutter.reset (new LineNumberGutter (*this));
+            addAndMakeVisible (lineNumberGutter.get());
+        }
+        else
+        {
+            lineNumberGutter.reset();
+        }
+
+        resized();
+        repaint();
+    }
+}
+
 void UnicodeTextEditor::setReadOnly (bool shouldBeReadOnly)
 {
     if (readOnly != shouldBeReadOnly)
@@ -1087,6 +4065,7 @@ void UnicodeTextEditor::applyFontToAllText (const juce::Font& newFont, bool chan
     }
 
     coalesceSimilarSections();
+    lineIndex->invalidateAll();
     checkLayout();
     scrollToMakeSureCursorIsVisible();
     repaint();
@@ -1097,12 +4076,138 @@ void UnicodeTextEditor::applyColourToAllText (const juce::Colour& newColour, boo
     for (auto* uts : sections)
         uts->colour = newColour;
 
+    lineIndex->invalidateAll();
+
     if (changeCurrentTextColour)
         setColour (juce::TextEditor::textColourId, newColour);
     else
         repaint();
 }
 
+void UnicodeTextEditor::setZoomFactor (float newZoomFactor)
+{
+    jassert (newZoomFactor > 0.0f);
+
+    if (zoomFactor != newZoomFactor)
+    {
+        zoomFactor = newZoomFactor;
+        atomWidthsNeedRefining = true;
+
+        resized();
+        repaint();
+    }
+}
+
+// Measures the atoms on the visible lines again at the current zoom factor, as the widths
+// that were scaled from the unzoomed fonts can be slightly out once hinting is taken into account.
+void UnicodeTextEditor::refineVisibleAtomWidths()
+{
+    atomWidthsNeedRefining = false;
+
+    // (at the normal size, the stored widths are already exact)
+    if (zoomFactor == 1.0f)
+        return;
+
+    const auto visibleRange = getVisibleTextRange();
+    auto anyChanged = false;
+    int index = 0;
+
+    for (auto* s : sections)
+    {
+        if (index >= visibleRange.getEnd())
+            break;
+
+        const auto length = s->getTotalLength();
+        const auto r = (visibleRange - index).getIntersectionWith ({ 0, length });
+
+        if (! r.isEmpty())
+            anyChanged = s->refineWidths (s->findAtomContaining (r.getStart()),
+                                          s->findAtomContaining (r.getEnd() - 1) + 1, zoomFactor) || anyChanged;
+
+        index += length;
+    }
+
+    if (anyChanged)
+        lineIndex->textChanged (visibleRange.getStart(), visibleRange.getLength(), visibleRange.getLength());
+}
+
+juce::Range<int> UnicodeTextEditor::getVisibleTextRange() const
+{
+    const auto top = (float) (viewport->getViewPositionY() - topIndent) - lineIndex->getYOffset();
+    const auto& firstLine = lineIndex->getLine (lineIndex->findLineAtY (top));
+    const auto& lastLine  = lineIndex->getLine (lineIndex->findLineAtY (top + (float) viewport->getMaximumVisibleHeight()));
+
+    return { firstLine.startIndex, lastLine.startIndex + lastLine.numChars };
+}
+
+//==============================================================================
+void UnicodeTextEditor::setExpandedTextLimit (int maxNumExpandedChars)
+{
+    expandedTextLimit = juce::jmax (0, maxNumExpandedChars);
+
+    if (expandedTextLimit > 0)
+    {
+        // break up the sections that were coalesced before there was a limit
+        splitIntoChunks (0, sections.size());
+        compressColdSections();
+    }
+}
+
+// Compresses the sections that have gone longest without being used until the expanded
+// text fits into the limit. The ones on screen are always left alone, as they'd only have
+// to be expanded again for the next repaint.
+void UnicodeTextEditor::compressColdSections()
+{
+    if (expandedTextLimit <= 0 || getWordWrapWidth() <= 0)
+        return;
+
+    expansionCountWhenCompressed = sectionClock.expansionCount;
+
+    struct Candidate
+    {
+        UniformTextSection* section;
+        juce::uint32 lastUseTime;
+        int length;
+    };
+
+    // while the layout is still pending, the text it hasn't reached yet is left alone too
+    const auto visibleRange = getVisibleTextRange();
+    const auto laidOutEnd = lineIndex->getLaidOutEnd();
+    juce::Array<Candidate> candidates;
+    int index = 0, numExpandedChars = 0;
+
+    for (auto* s : sections)
+    {
+        const auto length = s->getTotalLength();
+
+        if (! s->isCompressed())
+        {
+            numExpandedChars += length;
+
+            if (! visibleRange.intersects ({ index, index + length }) && index + length <= laidOutEnd)
+                candidates.add ({ s, s->getLastUseTime(), length });
+        }
+
+        index += length;
+    }
+
+    if (numExpandedChars <= expandedTextLimit)
+        return;
+
+    // a stable sort, so that among sections that were last used together, the oldest text goes first
+    std::stable_sort (candidates.begin(), candidates.end(),
+                      [] (const Candidate& a, const Candidate& b) { return a.lastUseTime < b.lastUseTime; });
+
+    for (auto& c : candidates)
+    {
+        if (numExpandedChars <= expandedTextLimit)
+            break;
+
+        if (c.section->compress())
+            numExpandedChars -= c.length;
+    }
+}
+
 void UnicodeTextEditor::lookAndFeelChanged()
 {
     caret.reset();
@@ -1152,73 +4257,271 @@ void UnicodeTextEditor::updateCaretPosition()
     if (caret != nullptr
         && getWidth() > 0 && getHeight() > 0)
     {
-        Iterator i (*this);
         caret->setCaretPosition (getCaretRectangle().translated (leftIndent,
-                                                                 topIndent + juce::roundToInt (i.getYOffset())) - getTextOffset());
+                                                                 topIndent + juce::roundToInt (lineIndex->getYOffset())) - getTextOffset());
 
         if (auto* handler = getAccessibilityHandler())
             handler->notifyAccessibilityEvent (juce::AccessibilityEvent::textSelectionChanged);
     }
 }
 
-UnicodeTextEditor::LengthAndCharacterRestriction::LengthAndCharacterRestriction (int maxLen, const juce::String& chars)
-    : allowedCharacters (chars), maxLength (maxLen)
+UnicodeTextEditor::LengthAndCharacterRestriction::LengthAndCharacterRestriction (int maxLen, const juce::String& chars)
+    : allowedCharacters (chars), maxLength (maxLen)
+{
+}
+
+juce::String UnicodeTextEditor::LengthAndCharacterRestriction::filterNewText (UnicodeTextEditor& ed, const juce::String& newInput)
+{
+    juce::String t (newInput);
+
+    if (allowedCharacters.isNotEmpty())
+        t = t.retainCharacters (allowedCharacters);
+
+    if (maxLength > 0)
+        t = t.substring (0, maxLength - (ed.getTotalNumChars() - ed.getHighlightedRegion().getLength()));
+
+    return t;
+}
+
+void UnicodeTextEditor::setInputFilter (InputFilter* newFilter, bool takeOwnership)
+{
+    inputFilter.set (newFilter, takeOwnership);
+}
+
+void UnicodeTextEditor::setInputRestrictions (int maxLen, const juce::String& chars)
+{
+    setInputFilter (new LengthAndCharacterRestriction (maxLen, chars), true);
+}
+
+void UnicodeTextEditor::setTextToShowWhenEmpty (const juce::String& text, juce::Colour colourToUse)
+{
+    textToShowWhenEmpty = text;
+    colourForTextWhenEmpty = colourToUse;
+}
+
+void UnicodeTextEditor::setPasswordCharacter (juce::juce_wchar newPasswordCharacter)
+{
+    if (passwordCharacter != newPasswordCharacter)
+    {
+        passwordCharacter = newPasswordCharacter;
+        applyFontToAllText (currentFont);
+    }
+}
+
+void UnicodeTextEditor::setScrollBarThickness (int newThicknessPixels)
+{
+    viewport->setScrollBarThickness (newThicknessPixels);
+}
+
+//==============================================================================
+void UnicodeTextEditor::clear()
+{
+    clearInternal (nullptr);
+    checkLayout();
+    undoManager->clearUndoHistory();
+    repaint();
+}
+
+//==============================================================================
+UnicodeTextEditor::DocumentState UnicodeTextEditor::saveState()
+{
+    auto contents = std::make_unique<DocumentState::Contents> (*this);
+    swapDocument (*contents);
+    return DocumentState (std::move (contents));
+}
+
+void UnicodeTextEditor::restoreState (DocumentState&& state)
+{
+    // a document can only go back into the editor that it was taken out of
+    jassert (state.contents == nullptr || state.contents->owner == this);
+
+    if (state.contents != nullptr && state.contents->owner == this)
+    {
+        swapDocument (*state.contents);
+        state.contents.reset();
+    }
+}
+
+//==============================================================================
+// Works out which cache file belongs to the current text and fonts. The atoms are hashed
+// rather than the text, as the widths only fit if the text is split up in the same way.
+// Font::toString() leaves out the horizontal scale and kerning, and names placeholder
+// typefaces rather than the ones they resolve to, so those are all hashed separately.
+// The saved widths are unzoomed, so the zoom factor isn't part of the key.
+juce::File UnicodeTextEditor::getLayoutCacheFile (const juce::File& cacheDirectory, int& numAtoms) const
+{
+    jassert (! hasCompressedSections());   // the atoms of every section are looked at here
+
+    juce::uint64 textHash = 14695981039346656037ull, styleHash = textHash;
+    numAtoms = 0;
+
+    auto combine = [] (juce::uint64& hash, juce::uint64 value)
+    {
+        hash = (hash ^ value) * 1099511628211ull;
+    };
+
+    combine (styleHash, (juce::uint64) TextEditorDefs::layoutCacheMagic);
+
+    const juce::Font* previousFont = nullptr;
+
+    for (auto* s : sections)
+    {
+        // (neighbouring sections usually share a font, and looking up its typeface isn't free)
+        if (previousFont == nullptr || *previousFont != s->font)
+        {
+            combine (styleHash, (juce::uint64) s->font.toString().hashCode64());
+            combine (styleHash, (juce::uint64) juce::roundToInt (s->font.getHorizontalScale() * 10000.0f));
+            combine (styleHash, (juce::uint64) juce::roundToInt (s->font.getExtraKerningFactor() * 10000.0f));
+
+            if (auto typeface = s->font.getTypefacePtr())
+                combine (styleHash, (juce::uint64) (typeface->getName() + "/" + typeface->getStyle()).hashCode64());
+
+            previousFont = &s->font;
+        }
+        else
+        {
+            combine (styleHash, 1);
+        }
+
+        for (auto& atom : s->getAtoms())
+            combine (textHash, (juce::uint64) atom.atomText.hashCode64());
+
+        combine (textHash, (juce::uint64) s->getTotalLength());
+        numAtoms += s->getAtoms().size();
+    }
+
+    combine (styleHash, (juce::uint64) passwordCharacter);
+
+    return cacheDirectory.getChildFile (juce::String::toHexString (textHash) + "_"
+                                          + juce::String::toHexString (styleHash) + ".layoutcache");
+}
+
+// The cache holds a width for every atom, so the compressed sections would all have to be
+// expanded again to save or load one, which is exactly what the limit is there to prevent.
+bool UnicodeTextEditor::hasCompressedSections() const noexcept
+{
+    for (auto* s : sections)
+        if (s->isCompressed())
+            return true;
+
+    return false;
+}
+
+bool UnicodeTextEditor::saveLayoutCache (const juce::File& cacheDirectory) const
+{
+    if (hasCompressedSections() || cacheDirectory.createDirectory().failed())
+        return false;
+
+    int numAtoms = 0;
+    juce::TemporaryFile temp (getLayoutCacheFile (cacheDirectory, numAtoms));
+
+    {
+        juce::FileOutputStream out (temp.getFile());
+
+        if (! out.openedOk())
+            return false;
+
+        out.writeInt (TextEditorDefs::layoutCacheMagic);
+        out.writeInt (numAtoms);
+
+        for (auto* s : sections)
+            s->writeAtomWidths (out);
+
+        out.flush();
+
+        if (out.getStatus().failed())
+            return false;
+    }
+
+    return temp.overwriteTargetFileWithTemporary();
+}
+
+bool UnicodeTextEditor::loadLayoutCache (const juce::File& cacheDirectory)
 {
+    if (! readLayoutCache (cacheDirectory))
+        return false;
+
+    lineIndex->invalidateAll();
+    checkLayout();
+    updateCaretPosition();
+    repaint();
+    return true;
 }
 
-juce::String UnicodeTextEditor::LengthAndCharacterRestriction::filterNewText (UnicodeTextEditor& ed, const juce::String& newInput)
+// Reads the atoms' widths from the cache file without laying anything out again.
+bool UnicodeTextEditor::readLayoutCache (const juce::File& cacheDirectory)
 {
-    juce::String t (newInput);
-
-    if (allowedCharacters.isNotEmpty())
-        t = t.retainCharacters (allowedCharacters);
+    if (hasCompressedSections())
+        return false;
 
-    if (maxLength > 0)
-        t = t.substring (0, maxLength - (ed.getTotalNumChars() - ed.getHighlightedRegion().getLength()));
+    int numAtoms = 0;
+    const auto file = getLayoutCacheFile (cacheDirectory, numAtoms);
 
-    return t;
-}
+    // the widths are read straight out of the mapped file, rather than loading all of it first
+    juce::MemoryMappedFile mapped (file, juce::MemoryMappedFile::readOnly);
 
-void UnicodeTextEditor::setInputFilter (InputFilter* newFilter, bool takeOwnership)
-{
-    inputFilter.set (newFilter, takeOwnership);
-}
+    if (mapped.getData() == nullptr
+         || mapped.getSize() != (size_t) TextEditorDefs::layoutCacheHeaderSize + (size_t) numAtoms * sizeof (float))
+        return false;
 
-void UnicodeTextEditor::setInputRestrictions (int maxLen, const juce::String& chars)
-{
-    setInputFilter (new LengthAndCharacterRestriction (maxLen, chars), true);
-}
+    juce::MemoryInputStream in (mapped.getData(), mapped.getSize(), false);
 
-void UnicodeTextEditor::setTextToShowWhenEmpty (const juce::String& text, juce::Colour colourToUse)
-{
-    textToShowWhenEmpty = text;
-    colourForTextWhenEmpty = colourToUse;
-}
+    if (in.readInt() != TextEditorDefs::layoutCacheMagic || in.readInt() != numAtoms)
+        return false;
 
-void UnicodeTextEditor::setPasswordCharacter (juce::juce_wchar newPasswordCharacter)
-{
-    if (passwordCharacter != newPasswordCharacter)
-    {
-        passwordCharacter = newPasswordCharacter;
-        applyFontToAllText (currentFont);
-    }
-}
+    for (auto* s : sections)
+        s->readAtomWidths (in);
 
-void UnicodeTextEditor::setScrollBarThickness (int newThicknessPixels)
-{
-    viewport->setScrollBarThickness (newThicknessPixels);
+    return true;
 }
 
 //==============================================================================
-void UnicodeTextEditor::clear()
+// Exchanges the editor's document with the one held in a saved state. Everything is moved
+// rather than copied, and the line index keeps its layout, so this only needs a repaint
+// unless the editor has changed size in the meantime.
+void UnicodeTextEditor::swapDocument (DocumentState::Contents& other)
 {
-    clearInternal (nullptr);
+    newTransaction();
+
+    sections.swapWith (other.sections);
+    sectionStarts.clearQuick();
+    std::swap (lineIndex, other.lineIndex);
+    std::swap (anchors, other.anchors);
+    std::swap (decorations, other.decorations);
+    std::swap (lineFilter, other.lineFilter);
+    std::swap (undoManager, other.undoManager);
+    foldedRanges.swapWith (other.foldedRanges);
+    inlays.swapWith (other.inlays);
+    extraSelections.swapWith (other.extraSelections);
+    underlinedSections.swapWith (other.underlinedSections);
+    std::swap (selection, other.selection);
+    std::swap (caretPosition, other.caretPosition);
+    std::swap (wordCount, other.wordCount);
+    std::swap (newLineCount, other.newLineCount);
+
+    totalNumChars = -1;
+    valueTextNeedsUpdating = true;
+
+    const auto oldViewPosition = viewport->getViewPosition();
     checkLayout();
-    undoManager.clearUndoHistory();
+    viewport->setViewPosition (other.viewPosition);
+    other.viewPosition = oldViewPosition;
+
+    if (lineFilter != nullptr)
+        lineFilter->resume();
+
+    updateCaretPosition();
+    textChanged();
     repaint();
 }
 
 void UnicodeTextEditor::setText (const juce::String& newText, bool sendTextChangeMessage)
+{
+    setText (newText, {}, sendTextChangeMessage);
+}
+
+void UnicodeTextEditor::setText (const juce::String& newText, const juce::File& layoutCacheDirectory,
+                                 bool sendTextChangeMessage)
 {
     auto newLength = newText.length();
 
@@ -1232,8 +4535,22 @@ void UnicodeTextEditor::setText (const juce::String& newText, bool sendTextChang
         auto oldCursorPos = caretPosition;
         bool cursorWasAtEnd = oldCursorPos >= getTotalNumChars();
 
+        clearExtraSelections();
         clearInternal (nullptr);
-        insert (newText, 0, currentFont, findColour (textColourId), nullptr, caretPosition);
+
+        if (layoutCacheDirectory == juce::File())
+        {
+            insert (newText, 0, currentFont, findColour (textColourId), nullptr, caretPosition);
+        }
+        else
+        {
+            // the cached widths have to be in place before anything is laid out and measured,
+            // so this puts the text in without the layout that insert() would do
+            if (newText.isNotEmpty())
+                insertSection (std::make_unique<UniformTextSection> (newText, currentFont, findColour (textColourId), passwordCharacter), 0);
+
+            readLayoutCache (layoutCacheDirectory);
+        }
 
         // if you're adding text with line-feeds to a single-line text editor, it
         // ain't gonna look right!
@@ -1251,10 +4568,14 @@ void UnicodeTextEditor::setText (const juce::String& newText, bool sendTextChang
 
         checkLayout();
         scrollToMakeSureCursorIsVisible();
-        undoManager.clearUndoHistory();
+        undoManager->clearUndoHistory();
 
         repaint();
     }
+    else if (layoutCacheDirectory != juce::File())
+    {
+        loadLayoutCache (layoutCacheDirectory);
+    }
 }
 
 //==============================================================================
@@ -1341,11 +4662,9 @@ void UnicodeTextEditor::repaintText (juce::Range<int> range)
             return;
         }
 
-        Iterator i (*this);
-
         juce::Point<float> anchor;
-        auto lh = currentFont.getHeight();
-        i.getCharPosition (range.getStart(), anchor, lh);
+        auto lh = currentFont.getHeight() * zoomFactor;
+        getCharPosition (range.getStart(), anchor, lh);
 
         auto y1 = std::trunc (anchor.y);
         int y2 = 0;
@@ -1356,11 +4675,11 @@ void UnicodeTextEditor::repaintText (juce::Range<int> range)
         }
         else
         {
-            i.getCharPosition (range.getEnd(), anchor, lh);
+            getCharPosition (range.getEnd(), anchor, lh);
             y2 = (int) (anchor.y + lh * 2.0f);
         }
 
-        auto offset = i.getYOffset();
+        auto offset = lineIndex->getYOffset();
         textHolder->repaint (0, juce::roundToInt (y1 + offset), textHolder->getWidth(), juce::roundToInt ((float) y2 - y1 + offset));
     }
 }
@@ -1373,6 +4692,14 @@ void UnicodeTextEditor::moveCaret (int newCaretPos)
     else
         newCaretPos = juce::jmin (newCaretPos, getTotalNumChars());
 
+    auto fold = findFoldContaining (newCaretPos);
+
+    if (fold >= 0)
+    {
+        auto range = foldedRanges.getReference (fold).range;
+        newCaretPos = newCaretPos >= caretPosition ? range.getEnd() : range.getStart();
+    }
+
     if (newCaretPos != getCaretPosition())
     {
         caretPosition = newCaretPos;
@@ -1440,7 +4767,7 @@ void UnicodeTextEditor::scrollEditorToPositionCaret (const int desiredCaretX,
 juce::Rectangle<int> UnicodeTextEditor::getCaretRectangleForCharIndex (int index) const
 {
     juce::Point<float> anchor;
-    auto cursorHeight = currentFont.getHeight(); // (in case the text is empty and the call below doesn't set this value)
+    auto cursorHeight = currentFont.getHeight() * zoomFactor; // (in case the text is empty and the call below doesn't set this value)
     getCharPosition (index, anchor, cursorHeight);
 
     return juce::Rectangle<float> { anchor.x, anchor.y, 2.0f, cursorHeight }.getSmallestIntegerContainer() + getTextOffset();
@@ -1448,27 +4775,15 @@ juce::Rectangle<int> UnicodeTextEditor::getCaretRectangleForCharIndex (int index
 
 juce::Point<int> UnicodeTextEditor::getTextOffset() const noexcept
 {
-    Iterator i (*this);
-    auto yOffset = i.getYOffset();
+    auto yOffset = lineIndex->getYOffset();
 
-    return { getLeftIndent() + borderSize.getLeft() - viewport->getViewPositionX(),
+    return { getLeftIndent() + borderSize.getLeft() + getLineNumberGutterWidth() - viewport->getViewPositionX(),
         juce::roundToInt ((float) getTopIndent() + (float) borderSize.getTop() + yOffset) - viewport->getViewPositionY() };
 }
 
 juce::RectangleList<int> UnicodeTextEditor::getTextBounds (juce::Range<int> textRange) const
 {
-    juce::RectangleList<int> boundingBox;
-    Iterator i (*this);
-
-    while (i.next())
-    {
-        if (textRange.intersects ({ i.indexInText,
-                                    i.indexInText + i.atom->numChars }))
-        {
-            boundingBox.add (i.getTextBounds (textRange));
-        }
-    }
-
+    auto boundingBox = lineIndex->getTextBounds (textRange);
     boundingBox.offsetAll (getTextOffset());
     return boundingBox;
 }
@@ -1497,16 +4812,35 @@ void UnicodeTextEditor::checkLayout()
 {
     if (getWordWrapWidth() > 0)
     {
-        const auto textBottom = Iterator (*this).getTotalTextHeight() + topIndent;
+        const auto textBottom = lineIndex->getTotalTextHeight() + topIndent;
         const auto textRight = juce::jmax (viewport->getMaximumVisibleWidth(),
-                                     Iterator (*this).getTextRight() + leftIndent + rightEdgeSpace);
+                                     lineIndex->getTextRight() + leftIndent + rightEdgeSpace);
 
         textHolder->setSize (textRight, textBottom);
         viewport->setScrollBarsShown (scrollbarVisible && multiline && textBottom > viewport->getMaximumVisibleHeight(),
                                       scrollbarVisible && multiline && ! wordWrap && textRight > viewport->getMaximumVisibleWidth());
+
+        if (lineNumberGutter != nullptr)
+        {
+            if (lineNumberGutter->getRequiredWidth() != lineNumberGutter->getWidth())
+                resized();
+            else
+                lineNumberGutter->repaint();
+        }
+
+        for (auto* minimap : minimaps)
+            minimap->repaint();
+
+        if (lineIndex->isLayoutPending() || atomWidthsNeedRefining)
+            layoutTimer->startTimer (LayoutTimer::delayMs);
     }
 }
 
+int UnicodeTextEditor::getLineNumberGutterWidth() const
+{
+    return lineNumberGutter != nullptr ? lineNumberGutter->getWidth() : 0;
+}
+
 int UnicodeTextEditor::getTextWidth() const    { return textHolder->getWidth(); }
 int UnicodeTextEditor::getTextHeight() const   { return textHolder->getHeight(); }
 
@@ -1642,23 +4976,69 @@ void UnicodeTextEditor::insertTextAtCaret (const juce::String& t)
 {
     juce::String newText (inputFilter != nullptr ? inputFilter->filterNewText (*this, t) : t);
 
-    if (isMultiLine())
-        newText = newText.replace ("\r\n", "\n");
-    else
+    // A multi-line editor doesn't need to replace any "\r\n" pairs, as the section turns each one
+    // into a single new-line while it splits the text into atoms. That way, a big paste is only
+    // scanned once, and its length comes from the section rather than from another pass.
+    if (! isMultiLine() && newText.containsAnyOf ("\r\n"))
         newText = newText.replaceCharacters ("\r\n", "  ");
 
+    auto newSection = std::make_unique<UniformTextSection> (newText, currentFont, findColour (textColourId), passwordCharacter);
+
+    if (! extraSelections.isEmpty())
+    {
+        replaceSelections (std::move (newSection));
+        textChanged();
+        return;
+    }
+
     const int insertIndex = selection.getStart();
-    const int newCaretPos = insertIndex + newText.length();
+    const int newLength = newSection->getTotalLength();
+    const int newCaretPos = insertIndex + newLength;
 
     remove (selection, getUndoManager(),
-            newText.isNotEmpty() ? newCaretPos - 1 : newCaretPos);
+            newLength > 0 ? newCaretPos - 1 : newCaretPos);
 
-    insert (newText, insertIndex, currentFont, findColour (textColourId),
-            getUndoManager(), newCaretPos);
+    insert (std::move (newSection), insertIndex, getUndoManager(), newCaretPos);
 
     textChanged();
 }
 
+// Replaces every selection with the section, as a single undoable action.
+void UnicodeTextEditor::replaceSelections (std::unique_ptr<UniformTextSection> newSection)
+{
+    const auto ranges = getSelections();
+    const auto newLength = newSection->getTotalLength();
+    auto newCaretPos = caretPosition;
+    auto offset = 0;
+    auto hasAnythingToRemove = false;
+
+    for (auto& range : ranges)
+    {
+        // (the main selection may have been merged with others, but it's still inside one range)
+        if (range.getStart() <= selection.getStart() && selection.getEnd() <= range.getEnd())
+            newCaretPos = range.getStart() + offset + newLength;
+
+        offset += newLength - range.getLength();
+        hasAnythingToRemove = hasAnythingToRemove || ! range.isEmpty();
+    }
+
+    if (newLength == 0 && ! hasAnythingToRemove)
+        return;
+
+    if (auto* um = getUndoManager())
+    {
+        if (um->getNumActionsInCurrentTransaction() > TextEditorDefs::maxActionsPerTransaction)
+            newTransaction();
+
+        um->perform (new MultiReplaceAction (*this, ranges, std::move (newSection), caretPosition, newCaretPos));
+    }
+    else
+    {
+        juce::OwnedArray<juce::OwnedArray<UniformTextSection>> removedSections;
+        replaceRanges (ranges, *newSection, removedSections, newCaretPos);
+    }
+}
+
 void UnicodeTextEditor::setHighlightedRegion (const juce::Range<int>& newSelection)
 {
     if (newSelection == getHighlightedRegion())
@@ -1670,11 +5050,184 @@ void UnicodeTextEditor::setHighlightedRegion (const juce::Range<int>& newSelecti
     moveCaretTo (cursorAtStart ? newSelection.getStart() : newSelection.getEnd(), true);
 }
 
+//==============================================================================
+void UnicodeTextEditor::addSelection (juce::Range<int> newSelection)
+{
+    newSelection = newSelection.getIntersectionWith ({ 0, getTotalNumChars() });
+
+    // it goes in order among the others, and any that it reaches are joined to it, so that
+    // their ends stay in order as well as their starts
+    auto i = (int) (std::upper_bound (extraSelections.begin(), extraSelections.end(), newSelection.getStart(),
+                                      [this] (int start, const ExtraSelection& extra)
+                                      {
+                                          return start < anchors->getPosition (extra.startAnchorID);
+                                      })
+                      - extraSelections.begin());
+
+    auto removeExtra = [this] (int index)
+    {
+        const auto extra = extraSelections.removeAndReturn (index);
+        anchors->remove (extra.startAnchorID);
+        anchors->remove (extra.endAnchorID);
+    };
+
+    while (i > 0 && getExtraSelection (extraSelections.getReference (i - 1)).getEnd() >= newSelection.getStart())
+    {
+        newSelection = newSelection.getUnionWith (getExtraSelection (extraSelections.getReference (i - 1)));
+        removeExtra (--i);
+    }
+
+    while (i < extraSelections.size() && getExtraSelection (extraSelections.getReference (i)).getStart() <= newSelection.getEnd())
+    {
+        newSelection = newSelection.getUnionWith (getExtraSelection (extraSelections.getReference (i)));
+        removeExtra (i);
+    }
+
+    extraSelections.insert (i, { anchors->add (newSelection.getStart(), AnchorGravity::right),
+                                 anchors->add (newSelection.getEnd(), AnchorGravity::right) });
+
+    repaintText (newSelection.withLength (juce::jmax (1, newSelection.getLength())));
+}
+
+void UnicodeTextEditor::setBoxSelection (juce::Point<int> corner1, juce::Point<int> corner2)
+{
+    if (getWordWrapWidth() <= 0)
+        return;
+
+    const auto offset = getTextOffset().toFloat();
+    const auto p1 = corner1.toFloat() - offset;
+    const auto p2 = corner2.toFloat() - offset;
+
+    lineIndex->layOutDownTo (juce::jmax (p1.y, p2.y));
+
+    const auto line1 = lineIndex->findLineAtY (p1.y);
+    const auto line2 = lineIndex->findLineAtY (p2.y);
+    const auto left = juce::jmin (p1.x, p2.x), right = juce::jmax (p1.x, p2.x);
+    const auto topLine = juce::jmin (line1, line2);
+    const auto ranges = lineIndex->findRangesBetween (topLine, juce::jmax (line1, line2), left, right);
+
+    // The extra selections are one per line apart from the second corner's, in line order.
+    // They grow and shrink at the end away from the first corner's line, so while the box is
+    // being dragged out, the lines it already covered keep their anchors, and only the lines
+    // whose ranges have changed get new ones.
+    const auto numExtras = std::abs (line2 - line1);
+    const auto isGrowingDown = line2 > line1;
+
+    while (extraSelections.size() > numExtras)
+    {
+        const auto extra = extraSelections.removeAndReturn (isGrowingDown ? extraSelections.size() - 1 : 0);
+        anchors->remove (extra.startAnchorID);
+        anchors->remove (extra.endAnchorID);
+    }
+
+    const auto firstLine = isGrowingDown ? line1 : line2 + 1;
+    const auto numKept = extraSelections.size();
+    const auto firstNew = isGrowingDown ? numKept : 0;
+
+    for (int n = 0; n < numExtras; ++n)
+    {
+        const auto range = ranges.getReference (firstLine + n - topLine);
+
+        if (n >= firstNew && n < firstNew + numExtras - numKept)
+        {
+            extraSelections.insert (n, { anchors->add (range.getStart(), AnchorGravity::right),
+                                         anchors->add (range.getEnd(), AnchorGravity::right) });
+        }
+        else
+        {
+            auto& extra = extraSelections.getReference (n);
+
+            if (getExtraSelection (extra) != range)
+                setExtraSelection (extra, range);
+        }
+    }
+
+    setHighlightedRegion (ranges.getReference (line2 - topLine));
+    textHolder->repaint();
+}
+
+juce::Array<juce::Range<int>> UnicodeTextEditor::getSelections() const
+{
+    juce::Array<juce::Range<int>> all;
+    all.add (selection);
+
+    for (auto& extra : extraSelections)
+        all.add (getExtraSelection (extra));
+
+    std::sort (all.begin(), all.end(),
+               [] (juce::Range<int> a, juce::Range<int> b) { return a.getStart() < b.getStart(); });
+
+    juce::Array<juce::Range<int>> merged;
+
+    for (auto& range : all)
+    {
+        if (! merged.isEmpty() && range.getStart() <= merged.getReference (merged.size() - 1).getEnd())
+            merged.getReference (merged.size() - 1) = merged.getReference (merged.size() - 1).getUnionWith (range);
+        else
+            merged.add (range);
+    }
+
+    return merged;
+}
+
+void UnicodeTextEditor::clearExtraSelections()
+{
+    if (extraSelections.isEmpty())
+        return;
+
+    for (auto& extra : extraSelections)
+    {
+        anchors->remove (extra.startAnchorID);
+        anchors->remove (extra.endAnchorID);
+    }
+
+    extraSelections.clear();
+    textHolder->repaint();
+}
+
+juce::Range<int> UnicodeTextEditor::getExtraSelection (const ExtraSelection& extra) const
+{
+    return { anchors->getPosition (extra.startAnchorID), anchors->getPosition (extra.endAnchorID) };
+}
+
+void UnicodeTextEditor::setExtraSelection (ExtraSelection& extra, juce::Range<int> newRange)
+{
+    anchors->remove (extra.startAnchorID);
+    anchors->remove (extra.endAnchorID);
+
+    extra = { anchors->add (newRange.getStart(), AnchorGravity::right),
+              anchors->add (newRange.getEnd(), AnchorGravity::right) };
+}
+
 //==============================================================================
 void UnicodeTextEditor::copy()
+{
+    copySelection (true);
+}
+
+void UnicodeTextEditor::copySelection (bool allowDeferring)
 {
     if (passwordCharacter == 0)
     {
+        abandonDeferredCopy();
+
+        if (! extraSelections.isEmpty())
+        {
+            juce::StringArray selectedLines;
+
+            for (auto& range : getSelections())
+                selectedLines.add (getTextInRange (range));
+
+            juce::SystemClipboard::copyTextToClipboard (selectedLines.joinIntoString ("\n"));
+            return;
+        }
+
+        if (allowDeferring && selection.getLength() >= ClipboardWriter::minLengthToDefer)
+        {
+            clipboardWriter.reset (new ClipboardWriter (*this, selection));
+            return;
+        }
+
         auto selectedText = getHighlightedText();
 
         if (selectedText.isNotEmpty())
@@ -1682,6 +5235,17 @@ void UnicodeTextEditor::copy()
     }
 }
 
+void UnicodeTextEditor::abandonDeferredCopy()
+{
+    if (clipboardWriter != nullptr)
+    {
+        clipboardWriter.reset();
+
+        if (onCopyProgress != nullptr)
+            onCopyProgress (-1.0);
+    }
+}
+
 void UnicodeTextEditor::paste()
 {
     if (! isReadOnly())
@@ -1705,12 +5269,18 @@ void UnicodeTextEditor::cut()
 //==============================================================================
 void UnicodeTextEditor::drawContent (juce::Graphics& g)
 {
+    // (if anything has been expanded since the text was last compressed, the timer will put it back later)
+    if ((lineIndex->isLayoutPending()
+          || (expandedTextLimit > 0 && sectionClock.expansionCount != expansionCountWhenCompressed))
+         && ! layoutTimer->isTimerRunning())
+        layoutTimer->startTimer (LayoutTimer::delayMs);
+
     if (getWordWrapWidth() > 0)
     {
         g.setOrigin (leftIndent, topIndent);
         auto clip = g.getClipBounds();
 
-        auto yOffset = Iterator (*this).getYOffset();
+        auto yOffset = lineIndex->getYOffset();
 
         juce::AffineTransform transform;
 
@@ -1720,7 +5290,27 @@ void UnicodeTextEditor::drawContent (juce::Graphics& g)
             clip.setY (juce::roundToInt ((float) clip.getY() - yOffset));
         }
 
-        Iterator i (*this);
+        // the decorations on screen are looked up once; backgrounds go under the text, and lines over it
+        juce::Array<DecorationTree::Decoration> visibleDecorations;
+        juce::Range<int> visibleRange;
+
+        {
+            const auto& firstLine = lineIndex->getLine (lineIndex->findLineAtY ((float) clip.getY()));
+            const auto& lastLine  = lineIndex->getLine (lineIndex->findLineAtY ((float) clip.getBottom()));
+
+            visibleRange = { firstLine.startIndex, lastLine.startIndex + lastLine.numChars };
+            decorations->findOverlapping (visibleRange, visibleDecorations);
+        }
+
+        for (auto& decoration : visibleDecorations)
+        {
+            if (decoration.style == DecorationStyle::background)
+            {
+                g.setColour (decoration.colour);
+                g.fillPath (lineIndex->getTextBounds (decoration.range.getIntersectionWith (visibleRange)).toPath(), transform);
+            }
+        }
+
         juce::Colour selectedTextColour;
 
         if (! selection.isEmpty())
@@ -1735,37 +5325,118 @@ void UnicodeTextEditor::drawContent (juce::Graphics& g)
             g.fillPath (boundingBox.toPath(), transform);
         }
 
-        const UniformTextSection* lastSection = nullptr;
+        // the extra selections get a highlight, or a caret if they're empty, but their text isn't
+        // recoloured; as their ends are in order, the first one on screen can be looked up, and
+        // the rest are drawn until one starts below it
+        auto firstVisibleExtra = std::lower_bound (extraSelections.begin(), extraSelections.end(), visibleRange.getStart(),
+                                                   [this] (const ExtraSelection& extra, int start)
+                                                   {
+                                                       return anchors->getPosition (extra.endAnchorID) < start;
+                                                   });
 
-        while (i.next() && i.lineY < (float) clip.getBottom())
+        for (auto extra = firstVisibleExtra; extra != extraSelections.end(); ++extra)
         {
-            if (i.lineY + i.lineHeight >= (float) clip.getY())
+            const auto range = getExtraSelection (*extra);
+
+            if (range.getStart() > visibleRange.getEnd())
+                break;
+
+            if (! range.isEmpty())
             {
-                if (selection.intersects ({ i.indexInText, i.indexInText + i.atom->numChars }))
-                {
-                    i.drawSelectedText (g, selection, selectedTextColour, transform);
-                    lastSection = nullptr;
-                }
-                else
-                {
-                    i.draw (g, lastSection, transform);
-                }
+                g.setColour (findColour (highlightColourId).withMultipliedAlpha (hasKeyboardFocus (true) ? 1.0f : 0.5f));
+                g.fillPath (lineIndex->getTextBounds (range.getIntersectionWith (visibleRange)).toPath(), transform);
+            }
+            else if (caretVisible && hasKeyboardFocus (true) && ! isReadOnly())
+            {
+                // (this goes straight to the line index, rather than through the caret rectangle
+                // lookup, which would also work out the text offset each time)
+                juce::Point<float> anchor;
+                float caretHeight;
+                lineIndex->getCharPosition (range.getStart(), anchor, caretHeight);
+
+                g.setColour (findColour (juce::CaretComponent::caretColourId));
+                g.fillRect (juce::Rectangle<float> { anchor.x, anchor.y, 2.0f, caretHeight }
+                                .getSmallestIntegerContainer().toFloat().transformedBy (transform));
             }
         }
 
-        for (auto& underlinedSection : underlinedSections)
+        auto forEachVisibleAtom = [this, clip] (auto&& callback)
         {
-            Iterator i2 (*this);
+            if (wordWrap)
+            {
+                // the layout resumes at the start of the paragraph holding the first visible line,
+                // so the text above it isn't laid out again
+                auto n = lineIndex->findLineAtY ((float) clip.getY());
 
-            while (i2.next() && i2.lineY < (float) clip.getBottom())
+                // (the empty line after a trailing new-line can't be resumed from)
+                if (n > 0 && n == lineIndex->getNumLines() - 1 && lineIndex->getLine (n).numChars == 0)
+                    --n;
+
+                while (n > 0 && ! lineIndex->getLine (n).startsLogicalLine)
+                    --n;
+
+                const auto& firstLine = lineIndex->getLine (n);
+                Iterator i = n == 0 ? Iterator (*this)
+                                    : Iterator (*this, firstLine.startIndex, firstLine.y);
+
+                while (i.next() && i.lineY < (float) clip.getBottom())
+                    if (i.lineY + i.lineHeight >= (float) clip.getY())
+                        callback (i);
+
+                return;
+            }
+
+            // Without wrapping, every line starts a new paragraph and can be drawn on its own, so
+            // only the atoms that are inside the clip horizontally need to be visited.
+            const auto clipLeft = (float) clip.getX(), clipRight = (float) clip.getRight();
+
+            for (auto n = lineIndex->findLineAtY ((float) clip.getY()); n < lineIndex->getNumLines(); ++n)
             {
-                if (i2.lineY + i2.lineHeight >= (float) clip.getY()
-                      && underlinedSection.intersects ({ i2.indexInText, i2.indexInText + i2.atom->numChars }))
-                {
-                    i2.drawUnderline (g, underlinedSection, findColour (textColourId), transform);
-                }
+                const auto& line = lineIndex->getLine (n);
+
+                if (line.y >= (float) clip.getBottom())
+                    break;
+
+                if (line.numChars == 0 || line.right < clipLeft || line.left > clipRight)
+                    continue;
+
+                const auto lineEnd = line.startIndex + line.numChars;
+                Iterator i (*this, line.startIndex, line.y, line.height, line.left);
+                i.skipAtomsBefore (clipLeft, lineEnd);
+
+                while (i.next() && i.indexInText < lineEnd && i.atomX <= clipRight)
+                    callback (i);
+            }
+        };
+
+        const UniformTextSection* lastSection = nullptr;
+
+        forEachVisibleAtom ([&] (Iterator& i)
+        {
+            if (selection.intersects ({ i.indexInText, i.indexInText + i.atom->numChars }))
+            {
+                i.drawSelectedText (g, selection, selectedTextColour, transform);
+                lastSection = nullptr;
             }
+            else
+            {
+                i.draw (g, lastSection, transform);
+            }
+        });
+
+        for (auto& underlinedSection : underlinedSections)
+        {
+            forEachVisibleAtom ([&] (Iterator& i)
+            {
+                if (underlinedSection.intersects ({ i.indexInText, i.indexInText + i.atom->numChars }))
+                    i.drawUnderline (g, underlinedSection, findColour (textColourId), transform);
+            });
         }
+
+        for (auto& decoration : visibleDecorations)
+            if (decoration.style != DecorationStyle::background)
+                for (auto area : lineIndex->getTextBounds (decoration.range.getIntersectionWith (visibleRange)))
+                    DecorationTree::drawLine (g, decoration, area.toFloat(), transform);
     }
 }
 
@@ -1783,7 +5454,7 @@ void UnicodeTextEditor::paintOverChildren (juce::Graphics& g)
         g.setColour (colourForTextWhenEmpty);
         g.setFont (getFont());
 
-        juce::Rectangle<int> textBounds (leftIndent,
+        juce::Rectangle<int> textBounds (leftIndent + getLineNumberGutterWidth(),
                                    topIndent,
                                    viewport->getWidth() - leftIndent,
                                    getHeight() - topIndent);
@@ -1814,8 +5485,8 @@ void UnicodeTextEditor::addPopupMenuItems (juce::PopupMenu& m, const juce::Mouse
 
     if (getUndoManager() != nullptr)
     {
-        m.addItem (juce::StandardApplicationCommandIDs::undo, TRANS("Undo"), undoManager.canUndo());
-        m.addItem (juce::StandardApplicationCommandIDs::redo, TRANS("Redo"), undoManager.canRedo());
+        m.addItem (juce::StandardApplicationCommandIDs::undo, TRANS("Undo"), undoManager->canUndo());
+        m.addItem (juce::StandardApplicationCommandIDs::redo, TRANS("Redo"), undoManager->canRedo());
     }
 }
 
@@ -1849,7 +5520,27 @@ void UnicodeTextEditor::mouseDown (const juce::MouseEvent& e)
     {
         if (! (popupMenuEnabled && e.mods.isPopupMenu()))
         {
-            moveCaretTo (getTextIndexAt (e.getPosition()), e.mods.isShiftDown());
+            auto fold = getFoldedRangeAt (e.getPosition());
+
+            if (e.mods.isAltDown() && fold.isEmpty())
+            {
+                // (a click adds a caret when the button is released, and dragging selects a box)
+                draggingBox = true;
+                boxSelectionStart = e.getPosition();
+                return;
+            }
+
+            clearExtraSelections();
+
+            if (! fold.isEmpty())
+            {
+                unfoldRange (fold);
+                moveCaretTo (fold.getStart(), false);
+            }
+            else
+            {
+                moveCaretTo (getTextIndexAt (e.getPosition()), e.mods.isShiftDown());
+            }
 
             if (auto* peer = getPeer())
                 peer->closeInputMethodContext();
@@ -1882,6 +5573,12 @@ void UnicodeTextEditor::mouseDrag (const juce::MouseEvent& e)
     if (! mouseDownInEditor)
         return;
 
+    if (draggingBox)
+    {
+        setBoxSelection (boxSelectionStart, e.getPosition());
+        return;
+    }
+
     if (wasFocused || ! selectAllTextWhenFocused)
         if (! (popupMenuEnabled && e.mods.isPopupMenu()))
             moveCaretTo (getTextIndexAt (e.getPosition()), true);
@@ -1895,6 +5592,16 @@ void UnicodeTextEditor::mouseUp (const juce::MouseEvent& e)
     newTransaction();
     textHolder->restartTimer();
 
+    if (draggingBox)
+    {
+        draggingBox = false;
+
+        if (e.mouseWasClicked())
+            addSelection (juce::Range<int>::emptyRange (getTextIndexAt (e.getPosition())));
+
+        return;
+    }
+
     if (wasFocused || ! selectAllTextWhenFocused)
         if (e.mouseWasClicked() && ! (popupMenuEnabled && e.mods.isPopupMenu()))
             moveCaret (getTextIndexAt (e.getPosition()));
@@ -1984,6 +5691,7 @@ void UnicodeTextEditor::mouseWheelMove (const juce::MouseEvent& e, const juce::M
 bool UnicodeTextEditor::moveCaretWithTransaction (const int newPos, const bool selecting)
 {
     newTransaction();
+    clearExtraSelections();
     moveCaretTo (newPos, selecting);
 
     if (auto* peer = getPeer())
@@ -2093,6 +5801,16 @@ bool UnicodeTextEditor::moveCaretToEndOfLine (bool selecting)
 
 bool UnicodeTextEditor::deleteBackwards (bool moveInWholeWordSteps)
 {
+    for (auto& extra : extraSelections)
+    {
+        const auto range = getExtraSelection (extra);
+
+        if (range.isEmpty() && range.getStart() > 0)
+            setExtraSelection (extra, { moveInWholeWordSteps ? findWordBreakBefore (range.getStart())
+                                                             : range.getStart() - 1,
+                                        range.getStart() });
+    }
+
     if (moveInWholeWordSteps)
         moveCaretTo (findWordBreakBefore (getCaretPosition()), true);
     else if (selection.isEmpty() && selection.getStart() > 0)
@@ -2104,6 +5822,14 @@ bool UnicodeTextEditor::deleteBackwards (bool moveInWholeWordSteps)
 
 bool UnicodeTextEditor::deleteForwards (bool /*moveInWholeWordSteps*/)
 {
+    for (auto& extra : extraSelections)
+    {
+        const auto range = getExtraSelection (extra);
+
+        if (range.isEmpty() && range.getStart() < getTotalNumChars())
+            setExtraSelection (extra, { range.getStart(), range.getStart() + 1 });
+    }
+
     if (selection.isEmpty() && selection.getStart() < getTotalNumChars())
         setSelection ({ selection.getStart(), selection.getStart() + 1 });
 
@@ -2121,7 +5847,7 @@ bool UnicodeTextEditor::copyToClipboard()
 bool UnicodeTextEditor::cutToClipboard()
 {
     newTransaction();
-    copy();
+    copySelection (false);   // (the text is about to go, so it can't be copied later)
     cut();
     return true;
 }
@@ -2172,6 +5898,7 @@ bool UnicodeTextEditor::keyPressed (const juce::KeyPress& key)
         else if (key.isKeyCode (juce::KeyPress::escapeKey))
         {
             newTransaction();
+            clearExtraSelections();
             moveCaretTo (getCaretPosition(), false);
             escapePressed();
             return consumeEscAndReturnKeys;
@@ -2231,90 +5958,490 @@ void UnicodeTextEditor::focusGained (FocusChangeType cause)
     updateCaretPosition();
 }
 
-void UnicodeTextEditor::focusLost (FocusChangeType)
+void UnicodeTextEditor::focusLost (FocusChangeType)
+{
+    newTransaction();
+
+    wasFocused = false;
+    textHolder->stopTimer();
+
+    underlinedSections.clear();
+
+    updateCaretPosition();
+
+    postCommandMessage (TextEditorDefs::focusLossMessageId);
+    repaint();
+}
+
+//==============================================================================
+void UnicodeTextEditor::resized()
+{
+    auto area = borderSize.subtractedFrom (getLocalBounds());
+
+    if (lineNumberGutter != nullptr)
+        lineNumberGutter->setBounds (area.removeFromLeft (lineNumberGutter->getRequiredWidth()));
+
+    viewport->setBounds (area);
+    viewport->setSingleStepSizes (16, juce::roundToInt (currentFont.getHeight() * zoomFactor));
+
+    checkLayout();
+
+    if (isMultiLine())
+        updateCaretPosition();
+    else
+        scrollToMakeSureCursorIsVisible();
+}
+
+void UnicodeTextEditor::handleCommandMessage (const int commandId)
+{
+    Component::BailOutChecker checker (this);
+
+    switch (commandId)
+    {
+    case TextEditorDefs::textChangeMessageId:
+        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorTextChanged (*this); });
+
+        if (! checker.shouldBailOut() && onTextChange != nullptr)
+            onTextChange();
+
+        break;
+
+    case TextEditorDefs::returnKeyMessageId:
+        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorReturnKeyPressed (*this); });
+
+        if (! checker.shouldBailOut() && onReturnKey != nullptr)
+            onReturnKey();
+
+        break;
+
+    case TextEditorDefs::escapeKeyMessageId:
+        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorEscapeKeyPressed (*this); });
+
+        if (! checker.shouldBailOut() && onEscapeKey != nullptr)
+            onEscapeKey();
+
+        break;
+
+    case TextEditorDefs::focusLossMessageId:
+        updateValueFromText();
+        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorFocusLost (*this); });
+
+        if (! checker.shouldBailOut() && onFocusLost != nullptr)
+            onFocusLost();
+
+        break;
+
+    default:
+        jassertfalse;
+        break;
+    }
+}
+
+void UnicodeTextEditor::setTemporaryUnderlining (const juce::Array<juce::Range<int>>& newUnderlinedSections)
+{
+    underlinedSections = newUnderlinedSections;
+    repaint();
+}
+
+//==============================================================================
+void UnicodeTextEditor::foldRange (juce::Range<int> rangeToFold)
+{
+    rangeToFold = rangeToFold.getIntersectionWith ({ 0, getTotalNumChars() });
+
+    if (rangeToFold.isEmpty())
+        return;
+
+    for (int i = foldedRanges.size(); --i >= 0;)
+    {
+        auto fold = foldedRanges.getReference (i).range;
+
+        if (fold.getEnd() >= rangeToFold.getStart() && fold.getStart() <= rangeToFold.getEnd())
+        {
+            rangeToFold = rangeToFold.getUnionWith (fold);
+            foldedRanges.remove (i);
+        }
+    }
+
+    // the iterator expects every fold to begin and end on a section boundary
+    splitSectionsAt (rangeToFold.getStart());
+    splitSectionsAt (rangeToFold.getEnd());
+
+    int insertIndex = 0;
+
+    while (insertIndex < foldedRanges.size() && foldedRanges.getReference (insertIndex).range.getStart() < rangeToFold.getStart())
+        ++insertIndex;
+
+    foldedRanges.insert (insertIndex, { rangeToFold, countNewLines (rangeToFold), false });
+    lineIndex->textChanged (rangeToFold.getStart(), rangeToFold.getLength(), rangeToFold.getLength());
+
+    foldsChanged();
+}
+
+void UnicodeTextEditor::unfoldRange (juce::Range<int> rangeToUnfold)
+{
+    bool anyRemoved = false;
+
+    for (int i = foldedRanges.size(); --i >= 0;)
+    {
+        auto fold = foldedRanges.getReference (i).range;
+
+        if (! foldedRanges.getReference (i).hidden
+             && (fold.intersects (rangeToUnfold) || fold.contains (rangeToUnfold.getStart())))
+        {
+            foldedRanges.remove (i);
+            lineIndex->textChanged (fold.getStart(), fold.getLength(), fold.getLength());
+            anyRemoved = true;
+        }
+    }
+
+    if (anyRemoved)
+        foldsChanged();
+}
+
+void UnicodeTextEditor::unfoldAll()
+{
+    bool anyRemoved = false;
+
+    for (int i = foldedRanges.size(); --i >= 0;)
+    {
+        auto fold = foldedRanges.getReference (i);
+
+        if (! fold.hidden)
+        {
+            foldedRanges.remove (i);
+            lineIndex->textChanged (fold.range.getStart(), fold.range.getLength(), fold.range.getLength());
+            anyRemoved = true;
+        }
+    }
+
+    if (anyRemoved)
+        foldsChanged();
+}
+
+juce::Array<juce::Range<int>> UnicodeTextEditor::getFoldedRanges() const
+{
+    juce::Array<juce::Range<int>> ranges;
+
+    for (auto& fold : foldedRanges)
+        if (! fold.hidden)
+            ranges.add (fold.range);
+
+    return ranges;
+}
+
+//==============================================================================
+void UnicodeTextEditor::setLineFilter (std::function<bool (const juce::String&)> predicate)
+{
+    lineFilter.reset();
+
+    // the lines hidden by any previous filter stay hidden until the new one has been applied
+    if (predicate != nullptr)
+        lineFilter.reset (new LineFilter (*this, std::move (predicate)));
+    else
+        replaceHiddenRanges (0, {});
+}
+
+bool UnicodeTextEditor::isLineFilterActive() const noexcept
+{
+    return lineFilter != nullptr;
+}
+
+// Replaces the hidden ranges from the given index onwards, leaving the folds made with
+// foldRange() alone. A hidden range that runs past the index can only be covering the
+// last line of the text, which has no new-line in it, so it's just cut short.
+void UnicodeTextEditor::replaceHiddenRanges (int start, const juce::Array<FoldedRange>& newRanges)
+{
+    juce::Array<FoldedRange> kept;
+    auto firstChange = start;
+
+    for (auto fold : foldedRanges)
+    {
+        if (fold.hidden)
+        {
+            if (fold.range.getStart() >= start)
+                continue;
+
+            if (fold.range.getEnd() > start)
+            {
+                fold.range.setEnd (start);
+                firstChange = juce::jmin (firstChange, fold.range.getStart());
+            }
+        }
+
+        kept.add (fold);
+    }
+
+    juce::Array<FoldedRange> merged;
+
+    auto addFold = [this, &merged] (const FoldedRange& fold)
+    {
+        if (! merged.isEmpty())
+        {
+            auto& last = merged.getReference (merged.size() - 1);
+
+            if (fold.hidden && last.hidden && last.range.getEnd() == fold.range.getStart())
+            {
+                last.range.setEnd (fold.range.getEnd());
+                last.numNewLines += fold.numNewLines;
+                return;
+            }
+
+            if (last.range.getEnd() > fold.range.getStart())
+            {
+                // lines that are already inside a fold stay there, and a fold made with
+                // foldRange() cuts short any hidden lines that overlap it
+                if (fold.hidden)
+                    return;
+
+                last.range.setEnd (fold.range.getStart());
+                last.numNewLines = countNewLines (last.range);
+
+                if (last.range.isEmpty())
+                    merged.removeLast();
+            }
+        }
+
+        merged.add (fold);
+    };
+
+    for (int i = 0, j = 0; i < kept.size() || j < newRanges.size();)
+    {
+        if (j >= newRanges.size() || (i < kept.size() && kept.getReference (i).range.getStart() <= newRanges.getReference (j).range.getStart()))
+            addFold (kept.getReference (i++));
+        else
+            addFold (newRanges.getReference (j++));
+    }
+
+    // the iterator expects every fold to begin and end on a section boundary
+    juce::Array<int> boundaries;
+
+    for (auto& fold : merged)
+    {
+        if (fold.hidden && fold.range.getEnd() > firstChange)
+        {
+            boundaries.add (fold.range.getStart());
+            boundaries.add (fold.range.getEnd());
+        }
+    }
+
+    foldedRanges.swapWith (merged);
+    splitSectionsAt (boundaries);
+
+    if (firstChange == 0)
+    {
+        lineIndex->invalidateAll();
+    }
+    else
+    {
+        const auto numChanged = getTotalNumChars() - firstChange;
+        lineIndex->textChanged (firstChange, numChanged, numChanged);
+    }
+
+    foldsChanged();
+}
+
+//==============================================================================
+int UnicodeTextEditor::addAnchor (int index, AnchorGravity gravity)
+{
+    return anchors->add (juce::jlimit (0, getTotalNumChars(), index), gravity);
+}
+
+int UnicodeTextEditor::getAnchorPosition (int anchorID) const
+{
+    return anchors->getPosition (anchorID);
+}
+
+void UnicodeTextEditor::removeAnchor (int anchorID)
+{
+    anchors->remove (anchorID);
+}
+
+//==============================================================================
+int UnicodeTextEditor::addDecoration (juce::Range<int> range, DecorationStyle style, juce::Colour colour)
+{
+    range = range.getIntersectionWith ({ 0, getTotalNumChars() });
+    repaintText (range);
+    return decorations->add (range, style, colour);
+}
+
+void UnicodeTextEditor::removeDecoration (int decorationID)
+{
+    repaintText (decorations->getRange (decorationID));
+    decorations->remove (decorationID);
+}
+
+void UnicodeTextEditor::clearDecorations()
+{
+    decorations->clear();
+    textHolder->repaint();
+}
+
+juce::Range<int> UnicodeTextEditor::getDecorationRange (int decorationID) const
+{
+    return decorations->getRange (decorationID);
+}
+
+//==============================================================================
+int UnicodeTextEditor::addInlay (int index, const juce::String& text, juce::Colour colour)
+{
+    index = juce::jlimit (0, getTotalNumChars(), index);
+
+    const auto inlayID = anchors->add (index, AnchorGravity::left);
+    inlays.insert (findInlayAtOrAfter (index + 1), { inlayID, text, colour, -1.0f, {} });
+
+    // the iterator only puts an inlay between two atoms, so there needs to be a section boundary here
+    splitSectionsAt (index);
+
+    inlayChanged (index);
+    return inlayID;
+}
+
+void UnicodeTextEditor::setInlayText (int inlayID, const juce::String& newText)
+{
+    const auto i = findInlay (inlayID);
+
+    if (i < 0)
+    {
+        jassertfalse; // this inlay doesn't exist
+        return;
+    }
+
+    auto& inlay = inlays.getReference (i);
+
+    if (inlay.text != newText)
+    {
+        inlay.text = newText;
+        inlay.width = -1.0f;
+        inlayChanged (getInlayPosition (i));
+    }
+}
+
+void UnicodeTextEditor::removeInlay (int inlayID)
+{
+    const auto i = findInlay (inlayID);
+
+    if (i < 0)
+    {
+        jassertfalse; // this inlay doesn't exist
+        return;
+    }
+
+    const auto position = getInlayPosition (i);
+    inlays.remove (i);
+    anchors->remove (inlayID);
+    inlayChanged (position);
+}
+
+void UnicodeTextEditor::clearInlays()
+{
+    if (! inlays.isEmpty())
+    {
+        for (auto& inlay : inlays)
+            anchors->remove (inlay.anchorID);
+
+        inlays.clear();
+        lineIndex->invalidateAll();
+        inlayChanged (0);
+    }
+}
+
+int UnicodeTextEditor::getInlayPosition (int inlayIndex) const
 {
-    newTransaction();
+    return anchors->getPosition (inlays.getReference (inlayIndex).anchorID);
+}
 
-    wasFocused = false;
-    textHolder->stopTimer();
+// The inlays are kept in order of position. Their anchors all have the same gravity, so
+// edits never change that order.
+int UnicodeTextEditor::findInlayAtOrAfter (int index) const
+{
+    int start = 0, end = inlays.size();
 
-    underlinedSections.clear();
+    while (start < end)
+    {
+        const auto middle = (start + end) / 2;
 
-    updateCaretPosition();
+        if (getInlayPosition (middle) < index)
+            start = middle + 1;
+        else
+            end = middle;
+    }
 
-    postCommandMessage (TextEditorDefs::focusLossMessageId);
-    repaint();
+    return start;
 }
 
-//==============================================================================
-void UnicodeTextEditor::resized()
+int UnicodeTextEditor::findInlay (int inlayID) const
 {
-    viewport->setBoundsInset (borderSize);
-    viewport->setSingleStepSizes (16, juce::roundToInt (currentFont.getHeight()));
+    const auto position = anchors->getPosition (inlayID);
 
-    checkLayout();
+    for (auto i = findInlayAtOrAfter (position); i < inlays.size() && getInlayPosition (i) == position; ++i)
+        if (inlays.getReference (i).anchorID == inlayID)
+            return i;
 
-    if (isMultiLine())
-        updateCaretPosition();
-    else
-        scrollToMakeSureCursorIsVisible();
+    return -1;
 }
 
-void UnicodeTextEditor::handleCommandMessage (const int commandId)
+bool UnicodeTextEditor::isInlayPosition (int index) const
 {
-    Component::BailOutChecker checker (this);
-
-    switch (commandId)
-    {
-    case TextEditorDefs::textChangeMessageId:
-        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorTextChanged (*this); });
-
-        if (! checker.shouldBailOut() && onTextChange != nullptr)
-            onTextChange();
-
-        break;
+    const auto i = findInlayAtOrAfter (index);
+    return i < inlays.size() && getInlayPosition (i) == index;
+}
 
-    case TextEditorDefs::returnKeyMessageId:
-        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorReturnKeyPressed (*this); });
+void UnicodeTextEditor::inlayChanged (int index)
+{
+    lineIndex->textChanged (index, 0, 0);
+    checkLayout();
+    updateCaretPosition();
+    textHolder->repaint();
+}
 
-        if (! checker.shouldBailOut() && onReturnKey != nullptr)
-            onReturnKey();
+void UnicodeTextEditor::foldsChanged()
+{
+    coalesceSimilarSections();
+    checkLayout();
 
-        break;
+    moveCaret (caretPosition);
+    updateCaretPosition();
+    textHolder->repaint();
+}
 
-    case TextEditorDefs::escapeKeyMessageId:
-        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorEscapeKeyPressed (*this); });
+int UnicodeTextEditor::findFoldContaining (int index) const noexcept
+{
+    auto fold = std::upper_bound (foldedRanges.begin(), foldedRanges.end(), index,
+                                  [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); });
 
-        if (! checker.shouldBailOut() && onEscapeKey != nullptr)
-            onEscapeKey();
+    if (fold != foldedRanges.end() && fold->range.getStart() < index)
+        return (int) (fold - foldedRanges.begin());
 
-        break;
+    return -1;
+}
 
-    case TextEditorDefs::focusLossMessageId:
-        updateValueFromText();
-        listeners.callChecked (checker, [this] (Listener& l) { l.textEditorFocusLost (*this); });
+bool UnicodeTextEditor::isFoldBoundary (int index) const noexcept
+{
+    auto fold = std::lower_bound (foldedRanges.begin(), foldedRanges.end(), index,
+                                  [] (const FoldedRange& f, int i) { return f.range.getEnd() < i; });
 
-        if (! checker.shouldBailOut() && onFocusLost != nullptr)
-            onFocusLost();
+    return fold != foldedRanges.end()
+            && (fold->range.getStart() == index || fold->range.getEnd() == index);
+}
 
-        break;
+juce::Range<int> UnicodeTextEditor::getFoldedRangeAt (juce::Point<int> position) const
+{
+    if (! foldedRanges.isEmpty() && getWordWrapWidth() > 0)
+    {
+        const auto offset = getTextOffset();
 
-    default:
-        jassertfalse;
-        break;
+        if (auto* atom = lineIndex->findAtomAt ((float) (position.x - offset.x), (float) (position.y - offset.y)))
+            if (atom->isFoldPlaceholder)
+                return { atom->startIndex, atom->startIndex + atom->numChars };
     }
-}
 
-void UnicodeTextEditor::setTemporaryUnderlining (const juce::Array<juce::Range<int>>& newUnderlinedSections)
-{
-    underlinedSections = newUnderlinedSections;
-    repaint();
+    return {};
 }
 
 //==============================================================================
 juce::UndoManager* UnicodeTextEditor::getUndoManager() noexcept
 {
-    return readOnly ? nullptr : &undoManager;
+    return readOnly ? nullptr : undoManager.get();
 }
 
 void UnicodeTextEditor::clearInternal (juce::UndoManager* const um)
@@ -2326,13 +6453,21 @@ void UnicodeTextEditor::insert (const juce::String& text, int insertIndex, const
                                 juce::Colour colour, juce::UndoManager* um, int caretPositionToMoveTo)
 {
     if (text.isNotEmpty())
+        insert (std::make_unique<UniformTextSection> (text, font, colour, passwordCharacter),
+                insertIndex, um, caretPositionToMoveTo);
+}
+
+void UnicodeTextEditor::insert (std::unique_ptr<UniformTextSection> newSection, int insertIndex,
+                                juce::UndoManager* um, int caretPositionToMoveTo)
+{
+    if (newSection->getTotalLength() > 0)
     {
         if (um != nullptr)
         {
             if (um->getNumActionsInCurrentTransaction() > TextEditorDefs::maxActionsPerTransaction)
                 newTransaction();
 
-            um->perform (new InsertAction (*this, text, insertIndex, font, colour,
+            um->perform (new InsertAction (*this, std::move (newSection), insertIndex,
                                            caretPosition, caretPositionToMoveTo));
         }
         else
@@ -2340,179 +6475,411 @@ void UnicodeTextEditor::insert (const juce::String& text, int insertIndex, const
             repaintText ({ insertIndex, getTotalNumChars() }); // must do this before and after changing the data, in case
                                                                // a line gets moved due to word wrap
 
-            int index = 0;
-            int nextIndex = 0;
+            insertSection (std::move (newSection), insertIndex);
 
-            for (int i = 0; i < sections.size(); ++i)
-            {
-                nextIndex = index + sections.getUnchecked (i)->getTotalLength();
+            checkLayout();
+            moveCaretTo (caretPositionToMoveTo, false);
 
-                if (insertIndex == index)
-                {
-                    sections.insert (i, new UniformTextSection (text, font, colour, passwordCharacter));
-                    break;
-                }
+            repaintText ({ insertIndex, getTotalNumChars() });
+        }
+    }
+}
 
-                if (insertIndex > index && insertIndex < nextIndex)
-                {
-                    splitSection (i, insertIndex - index);
-                    sections.insert (i + 1, new UniformTextSection (text, font, colour, passwordCharacter));
-                    break;
-                }
+// Puts a section into the text without any layout, caret movement or repainting, so that
+// a batch of edits only has to do those things once.
+void UnicodeTextEditor::insertSection (std::unique_ptr<UniformTextSection> newSection, int insertIndex)
+{
+    const auto oldNumChars = getTotalNumChars();
+    int index = 0;
+    int i = 0;
 
-                index = nextIndex;
-            }
+    // (the password character may have changed since an undoable insert was made)
+    newSection->setFont (newSection->font, passwordCharacter);
+    newSection->setClock (&sectionClock);
+
+    for (; i < sections.size(); ++i)
+    {
+        auto nextIndex = index + sections.getUnchecked (i)->getTotalLength();
+
+        if (insertIndex == index)
+            break;
+
+        if (insertIndex > index && insertIndex < nextIndex)
+        {
+            splitSection (i++, insertIndex - index);
+            break;
+        }
+
+        index = nextIndex;
+    }
+
+    auto end = i;
+
+    if (i < sections.size() || index == insertIndex)
+    {
+        sections.insert (i, newSection.release());
+        sectionStarts.clearQuick();
+        end = splitIntoChunks (i, i + 1);
+        updateTextCounts (i, end, 1);
+    }
+
+    totalNumChars = -1;
+    const auto numInserted = getTotalNumChars() - oldNumChars;
+    textRangeChanged (insertIndex, 0, numInserted);
+
+    // only the new section's neighbours can be joined to it
+    coalesceSectionsAt (end, insertIndex + numInserted);
+    coalesceSectionsAt (i, insertIndex);
+    valueTextNeedsUpdating = true;
+}
+
+// Moves the sections back into place, leaving the array empty. Only the sections on either
+// side of them can have become joinable, so those are the only ones that get coalesced.
+void UnicodeTextEditor::reinsert (int insertIndex, juce::OwnedArray<UniformTextSection>& sectionsToInsert)
+{
+    const auto oldNumChars = getTotalNumChars();
+    const auto numToInsert = sectionsToInsert.size();
+    int index = 0;
+    int i = 0;
+
+    for (; i < sections.size(); ++i)
+    {
+        auto nextIndex = index + sections.getUnchecked (i)->getTotalLength();
+
+        if (insertIndex == index)
+            break;
+
+        if (insertIndex > index && insertIndex < nextIndex)
+        {
+            splitSection (i++, insertIndex - index);
+            break;
+        }
+
+        index = nextIndex;
+    }
+
+    // (the password character may have changed since the sections were removed)
+    for (auto* s : sectionsToInsert)
+    {
+        s->setFont (s->font, passwordCharacter);
+        s->setClock (&sectionClock);
+    }
+
+    sections.insertArray (i, sectionsToInsert.begin(), numToInsert);
+    sectionsToInsert.clear (false);
+    sectionStarts.clearQuick();
 
-            if (nextIndex == insertIndex)
-                sections.add (new UniformTextSection (text, font, colour, passwordCharacter));
+    const auto end = splitIntoChunks (i, i + numToInsert);
+    updateTextCounts (i, end, 1);
+
+    totalNumChars = -1;
+    const auto numInserted = getTotalNumChars() - oldNumChars;
+    textRangeChanged (insertIndex, 0, numInserted);
+
+    coalesceSectionsAt (end, insertIndex + numInserted);
+    coalesceSectionsAt (i, insertIndex);
+    valueTextNeedsUpdating = true;
+}
+
+void UnicodeTextEditor::remove (juce::Range<int> range, juce::UndoManager* const um, const int caretPositionToMoveTo,
+                                juce::OwnedArray<UniformTextSection>* removedSections)
+{
+    if (! range.isEmpty())
+    {
+        if (um != nullptr)
+        {
+            if (um->getNumActionsInCurrentTransaction() > TextEditorDefs::maxActionsPerTransaction)
+                newTransaction();
 
-            coalesceSimilarSections();
-            totalNumChars = -1;
-            valueTextNeedsUpdating = true;
+            um->perform (new RemoveAction (*this, range, caretPosition, caretPositionToMoveTo));
+        }
+        else
+        {
+            removeSections (range, removedSections);
 
             checkLayout();
             moveCaretTo (caretPositionToMoveTo, false);
 
-            repaintText ({ insertIndex, getTotalNumChars() });
+            repaintText ({ range.getStart(), getTotalNumChars() });
         }
     }
 }
 
-void UnicodeTextEditor::reinsert (int insertIndex, const juce::OwnedArray<UniformTextSection>& sectionsToInsert)
+// Adds the words and new-lines in a run of sections to the totals for the whole text, or
+// takes them away if sign is -1. A word that carries on across either end of the run is only
+// counted once, whether the run is there or not.
+void UnicodeTextEditor::updateTextCounts (int firstSection, int endSection, int sign)
+{
+    auto joinsWords = [this] (int before, int after)
+    {
+        return before >= 0 && after < sections.size()
+                && sections.getUnchecked (before)->endsWithWord()
+                && sections.getUnchecked (after)->startsWithWord() ? 1 : 0;
+    };
+
+    auto words = joinsWords (firstSection - 1, endSection);
+    auto newLines = 0;
+
+    for (int i = firstSection; i < endSection; ++i)
+    {
+        auto* s = sections.getUnchecked (i);
+        words += s->getNumWords() - joinsWords (i - 1, i);
+        newLines += s->getNumNewLines();
+    }
+
+    words -= joinsWords (endSection - 1, endSection);
+
+    wordCount += sign * words;
+    newLineCount += sign * newLines;
+}
+
+// Takes a range out of the text without any layout, caret movement or repainting. If the
+// array is supplied, the removed sections are moved into it rather than deleted.
+void UnicodeTextEditor::removeSections (juce::Range<int> range, juce::OwnedArray<UniformTextSection>* removedSections)
 {
+    if (range.isEmpty())
+        return;
+
     int index = 0;
-    int nextIndex = 0;
 
     for (int i = 0; i < sections.size(); ++i)
     {
-        nextIndex = index + sections.getUnchecked (i)->getTotalLength();
+        auto nextIndex = index + sections.getUnchecked(i)->getTotalLength();
 
-        if (insertIndex == index)
+        if (range.getStart() > index && range.getStart() < nextIndex)
+        {
+            splitSection (i, range.getStart() - index);
+            --i;
+        }
+        else if (range.getEnd() > index && range.getEnd() < nextIndex)
+        {
+            splitSection (i, range.getEnd() - index);
+            --i;
+        }
+        else
         {
-            for (int j = sectionsToInsert.size(); --j >= 0;)
-                sections.insert (i, new UniformTextSection (*sectionsToInsert.getUnchecked(j)));
+            index = nextIndex;
 
-            break;
+            if (index > range.getEnd())
+                break;
         }
+    }
 
-        if (insertIndex > index && insertIndex < nextIndex)
-        {
-            splitSection (i, insertIndex - index);
+    // the range now starts and ends on section boundaries
+    const auto oldNumChars = getTotalNumChars();
+    int spliceIndex = 0, endSection = 0;
+    index = 0;
 
-            for (int j = sectionsToInsert.size(); --j >= 0;)
-                sections.insert (i + 1, new UniformTextSection (*sectionsToInsert.getUnchecked(j)));
+    while (spliceIndex < sections.size() && index < range.getStart())
+        index += sections.getUnchecked (spliceIndex++)->getTotalLength();
 
-            break;
-        }
+    for (endSection = spliceIndex; endSection < sections.size() && index < range.getEnd(); ++endSection)
+        index += sections.getUnchecked (endSection)->getTotalLength();
 
-        index = nextIndex;
+    updateTextCounts (spliceIndex, endSection, -1);
+
+    if (removedSections != nullptr)
+    {
+        for (int i = spliceIndex; i < endSection; ++i)
+            removedSections->add (sections.removeAndReturn (spliceIndex));
+    }
+    else
+    {
+        sections.removeRange (spliceIndex, endSection - spliceIndex);
     }
 
-    if (nextIndex == insertIndex)
-        for (auto* s : sectionsToInsert)
-            sections.add (new UniformTextSection (*s));
+    sectionStarts.clearQuick();
 
-    coalesceSimilarSections();
     totalNumChars = -1;
+    textRangeChanged (range.getStart(), oldNumChars - getTotalNumChars(), 0);
+    coalesceSectionsAt (spliceIndex, range.getStart());
     valueTextNeedsUpdating = true;
 }
 
-void UnicodeTextEditor::remove (juce::Range<int> range, juce::UndoManager* const um, const int caretPositionToMoveTo)
+//==============================================================================
+// Each range is replaced by a copy of the section, working backwards so that the ranges
+// before the one being changed stay where they are. The array receives what was removed
+// from each range, in the same order as the ranges.
+void UnicodeTextEditor::replaceRanges (const juce::Array<juce::Range<int>>& ranges, const UniformTextSection& newSection,
+                                       juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& removedSections,
+                                       int newCaretPos)
+{
+    if (ranges.isEmpty())
+        return;
+
+    const auto firstIndex = ranges.getFirst().getStart();
+    repaintText ({ firstIndex, getTotalNumChars() });
+
+    {
+        const juce::ScopedValueSetter<bool> batching (batchingEdits, true);
+
+        removedSections.clear();
+
+        for (int i = 0; i < ranges.size(); ++i)
+            removedSections.add (new juce::OwnedArray<UniformTextSection>());
+
+        spliceRanges (ranges, &newSection, removedSections);
+    }
+
+    finishBatchedEdit (firstIndex, newCaretPos);
+}
+
+// Reverses replaceRanges(), given the ranges as they were before it was called.
+void UnicodeTextEditor::restoreRanges (const juce::Array<juce::Range<int>>& ranges, int replacementLength,
+                                       juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& removedSections,
+                                       int newCaretPos)
 {
-    if (! range.isEmpty())
+    if (ranges.isEmpty())
+        return;
+
+    const auto firstIndex = ranges.getFirst().getStart();
+    repaintText ({ firstIndex, getTotalNumChars() });
+
     {
-        int index = 0;
+        const juce::ScopedValueSetter<bool> batching (batchingEdits, true);
 
-        for (int i = 0; i < sections.size(); ++i)
+        // where each replacement ended up, once the ranges before it had been replaced too
+        juce::Array<juce::Range<int>> replacements;
+        auto offset = 0;
+
+        for (auto& range : ranges)
         {
-            auto nextIndex = index + sections.getUnchecked(i)->getTotalLength();
+            replacements.add (juce::Range<int>::withStartAndLength (range.getStart() + offset, replacementLength));
+            offset += replacementLength - range.getLength();
+        }
 
-            if (range.getStart() > index && range.getStart() < nextIndex)
-            {
-                splitSection (i, range.getStart() - index);
-                --i;
-            }
-            else if (range.getEnd() > index && range.getEnd() < nextIndex)
-            {
-                splitSection (i, range.getEnd() - index);
-                --i;
-            }
-            else
-            {
-                index = nextIndex;
+        spliceRanges (replacements, nullptr, removedSections);
+    }
 
-                if (index > range.getEnd())
-                    break;
-            }
+    finishBatchedEdit (firstIndex, newCaretPos);
+}
+
+// Replaces a sorted list of separate ranges in one backwards pass over the sections. The
+// section before each splice and its start are kept, so finding the next range only walks
+// back over the sections in between, rather than along all of them from the start.
+// With a new section, each range is replaced by a copy of it, and what was removed from
+// the range is moved into the matching array. Without one, each range is deleted and the
+// sections in the matching array are moved back in its place.
+void UnicodeTextEditor::spliceRanges (const juce::Array<juce::Range<int>>& ranges, const UniformTextSection* newSection,
+                                      juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& sectionArrays)
+{
+    jassert (sectionArrays.size() == ranges.size());
+
+    auto sectionIndex = sections.size();
+    auto sectionStart = getTotalNumChars();
+
+    // moves back to the section containing an index, or starting at it
+    auto moveBackTo = [&] (int index)
+    {
+        while (sectionIndex > 0 && sectionStart > index)
+            sectionStart -= sections.getUnchecked (--sectionIndex)->getTotalLength();
+    };
+
+    for (int i = ranges.size(); --i >= 0;)
+    {
+        const auto range = ranges.getReference (i);
+        auto& sectionArray = *sectionArrays.getUnchecked (i);
+
+        // make the range start and end on section boundaries
+        moveBackTo (range.getEnd());
+
+        if (sectionStart < range.getEnd())
+        {
+            splitSection (sectionIndex++, range.getEnd() - sectionStart);
+            sectionStart = range.getEnd();
         }
 
-        index = 0;
+        auto endSection = sectionIndex;
 
-        if (um != nullptr)
+        moveBackTo (range.getStart());
+
+        if (sectionStart < range.getStart())
         {
-            juce::Array<UniformTextSection*> removedSections;
+            splitSection (sectionIndex++, range.getStart() - sectionStart);
+            sectionStart = range.getStart();
+            ++endSection;
+        }
 
-            for (auto* section : sections)
-            {
-                if (range.getEnd() <= range.getStart())
-                    break;
+        const auto spliceIndex = sectionIndex;
+        const auto previousStart = spliceIndex > 0 ? sectionStart - sections.getUnchecked (spliceIndex - 1)->getTotalLength() : 0;
+        const auto oldNumChars = getTotalNumChars();
 
-                auto nextIndex = index + section->getTotalLength();
+        updateTextCounts (spliceIndex, endSection, -1);
 
-                if (range.getStart() <= index && range.getEnd() >= nextIndex)
-                    removedSections.add (new UniformTextSection (*section));
+        if (newSection != nullptr)
+            for (int j = spliceIndex; j < endSection; ++j)
+                sectionArray.add (sections.getUnchecked (j));
 
-                index = nextIndex;
-            }
+        sections.removeRange (spliceIndex, endSection - spliceIndex, newSection == nullptr);
+        sectionStarts.clearQuick();
+        totalNumChars = oldNumChars - range.getLength();
+        textRangeChanged (range.getStart(), range.getLength(), 0);
 
-            if (um->getNumActionsInCurrentTransaction() > TextEditorDefs::maxActionsPerTransaction)
-                newTransaction();
+        auto numInserted = 0, numCharsInserted = 0;
 
-            um->perform (new RemoveAction (*this, range, caretPosition,
-                                           caretPositionToMoveTo, removedSections));
+        if (newSection != nullptr)
+        {
+            if (newSection->getTotalLength() > 0)
+            {
+                sections.insert (spliceIndex, new UniformTextSection (*newSection));
+                numInserted = 1;
+            }
         }
         else
         {
-            auto remainingRange = range;
+            numInserted = sectionArray.size();
+            sections.insertArray (spliceIndex, sectionArray.begin(), numInserted);
+            sectionArray.clear (false);
+        }
 
-            for (int i = 0; i < sections.size(); ++i)
+        if (numInserted > 0)
+        {
+            for (int j = spliceIndex; j < spliceIndex + numInserted; ++j)
             {
-                auto* section = sections.getUnchecked (i);
-                auto nextIndex = index + section->getTotalLength();
+                auto* s = sections.getUnchecked (j);
 
-                if (remainingRange.getStart() <= index && remainingRange.getEnd() >= nextIndex)
-                {
-                    sections.remove (i);
-                    remainingRange.setEnd (remainingRange.getEnd() - (nextIndex - index));
+                // (the password character may have changed since the edit was first made)
+                s->setFont (s->font, passwordCharacter);
+                s->setClock (&sectionClock);
+                numCharsInserted += s->getTotalLength();
+            }
 
-                    if (remainingRange.isEmpty())
-                        break;
+            sectionStarts.clearQuick();
+            updateTextCounts (spliceIndex, spliceIndex + numInserted, 1);
 
-                    --i;
-                }
-                else
-                {
-                    index = nextIndex;
-                }
-            }
+            totalNumChars += numCharsInserted;
+            textRangeChanged (range.getStart(), 0, numCharsInserted);
+            coalesceSectionsAt (spliceIndex + numInserted, range.getStart() + numCharsInserted);
+        }
+
+        // (joining anything onto the section before the splice leaves that section's start alone)
+        coalesceSectionsAt (spliceIndex, range.getStart());
+
+        sectionIndex = juce::jmax (0, spliceIndex - 1);
+        sectionStart = previousStart;
+    }
 
-            coalesceSimilarSections();
-            totalNumChars = -1;
-            valueTextNeedsUpdating = true;
+    valueTextNeedsUpdating = true;
+}
 
-            checkLayout();
-            moveCaretTo (caretPositionToMoveTo, false);
+void UnicodeTextEditor::finishBatchedEdit (int firstChangedIndex, int newCaretPos)
+{
+    // the line filter only noted where the batch's edits started, rather than copying the text
+    // after each one, so it tests from the earliest of them now
+    if (lineFilter != nullptr)
+        lineFilter->restart();
 
-            repaintText ({ range.getStart(), getTotalNumChars() });
-        }
-    }
+    checkLayout();
+    moveCaretTo (newCaretPos, false);
+
+    repaintText ({ firstChangedIndex, getTotalNumChars() });
 }
 
 //==============================================================================
 juce::String UnicodeTextEditor::getText() const
 {
     juce::MemoryOutputStream mo;
-    mo.preallocate ((size_t) getTotalNumChars());
+    mo.preallocate ((size_t) getNumBytesAsUTF8 ({ 0, getTotalNumChars() }));
 
     for (auto* s : sections)
         s->appendAllText (mo);
@@ -2526,7 +6893,7 @@ juce::String UnicodeTextEditor::getTextInRange (const juce::Range<int>& range) c
         return {};
 
     juce::MemoryOutputStream mo;
-    mo.preallocate ((size_t) juce::jmin (getTotalNumChars(), range.getLength()));
+    mo.preallocate ((size_t) getNumBytesAsUTF8 (range));
 
     int index = 0;
 
@@ -2553,6 +6920,26 @@ juce::String UnicodeTextEditor::getHighlightedText() const
     return getTextInRange (selection);
 }
 
+int UnicodeTextEditor::getNumBytesAsUTF8 (juce::Range<int> range) const
+{
+    int index = 0, total = 0;
+
+    for (auto* s : sections)
+    {
+        if (index >= range.getEnd())
+            break;
+
+        auto nextIndex = index + s->getTotalLength();
+
+        if (range.getStart() < nextIndex)
+            total += s->getNumBytesAsUTF8 (range - index);
+
+        index = nextIndex;
+    }
+
+    return total;
+}
+
 int UnicodeTextEditor::getTotalNumChars() const
 {
     if (totalNumChars < 0)
@@ -2576,43 +6963,23 @@ void UnicodeTextEditor::getCharPosition (int index, juce::Point<float>& anchor,
     if (getWordWrapWidth() <= 0)
     {
         anchor = {};
-        lineHeight = currentFont.getHeight();
+        lineHeight = currentFont.getHeight() * zoomFactor;
+    }
+    else if (sections.isEmpty())
+    {
+        anchor = { Iterator (*this).getJustificationOffsetX (0), 0 };
+        lineHeight = currentFont.getHeight() * zoomFactor;
     }
     else
     {
-        Iterator i (*this);
-
-        if (sections.isEmpty())
-        {
-            anchor = { i.getJustificationOffsetX (0), 0 };
-            lineHeight = currentFont.getHeight();
-        }
-        else
-        {
-            i.getCharPosition (index, anchor, lineHeight);
-        }
+        lineIndex->getCharPosition (index, anchor, lineHeight);
     }
 }
 
 int UnicodeTextEditor::indexAtPosition (const float x, const float y) const
 {
     if (getWordWrapWidth() > 0)
-    {
-        for (Iterator i (*this); i.next();)
-        {
-            if (y < i.lineY + i.lineHeight)
-            {
-                if (y < i.lineY)
-                    return juce::jmax (0, i.indexInText - 1);
-
-                if (x <= i.atomX || i.atom->isNewLine())
-                    return i.indexInText;
-
-                if (x < i.atomRight)
-                    return i.xToIndex (x);
-            }
-        }
-    }
+        return lineIndex->indexAtPosition (x, y);
 
     return getTotalNumChars();
 }
@@ -2671,23 +7038,464 @@ void UnicodeTextEditor::splitSection (const int sectionIndex, const int charToSp
 
     sections.insert (sectionIndex + 1,
                      sections.getUnchecked (sectionIndex)->split (charToSplitAt));
+    sectionStarts.clearQuick();
+}
+
+// Returns the index of the section containing a character, or the number of sections if the
+// index is at or beyond the end of the text. The start of each section is cached, so that the
+// layout can resume at any line without walking through all the sections before it.
+int UnicodeTextEditor::findSectionContaining (int index, int& sectionStart) const
+{
+    if (sectionStarts.size() != sections.size())
+    {
+        sectionStarts.clearQuick();
+        sectionStarts.ensureStorageAllocated (sections.size());
+
+        int start = 0;
+
+        for (auto* s : sections)
+        {
+            sectionStarts.add (start);
+            start += s->getTotalLength();
+        }
+    }
+
+    auto upper = std::upper_bound (sectionStarts.begin(), sectionStarts.end(), index);
+    auto i = juce::jmax (0, (int) (upper - sectionStarts.begin()) - 1);
+
+    if (i >= sections.size() || index >= sectionStarts.getUnchecked (i) + sections.getUnchecked (i)->getTotalLength())
+    {
+        sectionStart = getTotalNumChars();
+        return sections.size();
+    }
+
+    sectionStart = sectionStarts.getUnchecked (i);
+    return i;
+}
+
+// Splits the sections at a sorted list of indices, working backwards so that each split only
+// has to move the atoms up to the previous one.
+void UnicodeTextEditor::splitSectionsAt (const juce::Array<int>& sortedIndices)
+{
+    auto i = sections.size() - 1;
+    auto sectionEnd = getTotalNumChars();
+
+    for (int n = sortedIndices.size(); --n >= 0;)
+    {
+        const auto index = sortedIndices.getUnchecked (n);
+
+        while (i >= 0 && sectionEnd - sections.getUnchecked (i)->getTotalLength() > index)
+            sectionEnd -= sections.getUnchecked (i--)->getTotalLength();
+
+        if (i < 0)
+            break;
+
+        const auto sectionStart = sectionEnd - sections.getUnchecked (i)->getTotalLength();
+
+        if (index > sectionStart && index < sectionEnd)
+        {
+            splitSection (i, index - sectionStart);
+            sectionEnd = index;
+        }
+    }
+}
+
+// When there's a limit on the expanded text, breaks up any of a run of sections that are
+// longer than a chunk, so that a big insert can be compressed a piece at a time instead of
+// staying expanded as one section that's always in use. Returns the end of the run.
+int UnicodeTextEditor::splitIntoChunks (int firstSection, int endSection)
+{
+    if (expandedTextLimit <= 0)
+        return endSection;
+
+    for (int i = endSection; --i >= firstSection;)
+    {
+        // (splitting from the back means each split only moves one chunk's atoms)
+        const auto length = sections.getUnchecked (i)->getTotalLength();
+
+        for (int chunk = (length - 1) / TextEditorDefs::coldStorageChunkLength; chunk > 0; --chunk)
+        {
+            splitSection (i, chunk * TextEditorDefs::coldStorageChunkLength);
+            ++endSection;
+        }
+    }
+
+    return endSection;
+}
+
+void UnicodeTextEditor::splitSectionsAt (const int index)
+{
+    int sectionStart = 0;
+
+    for (int i = 0; i < sections.size(); ++i)
+    {
+        auto nextIndex = sectionStart + sections.getUnchecked (i)->getTotalLength();
+
+        if (index < nextIndex)
+        {
+            if (index > sectionStart)
+                splitSection (i, index - sectionStart);
+
+            break;
+        }
+
+        sectionStart = nextIndex;
+    }
+}
+
+// Returns true if two adjacent sections, the second of which starts at boundaryIndex, can be
+// joined into one.
+bool UnicodeTextEditor::canCoalesce (const UniformTextSection& s1, const UniformTextSection& s2, int boundaryIndex) const
+{
+    // (the colours are compared first, as that's much cheaper than comparing the fonts)
+    if (s1.colour != s2.colour || s1.font != s2.font)
+        return false;
+
+    // With an expanded-text limit, the text is kept in chunks that can be compressed separately,
+    // and sections that are already compressed are left alone rather than expanded to join them.
+    if (expandedTextLimit > 0
+         && (s1.isCompressed() || s2.isCompressed()
+              || s1.getTotalLength() + s2.getTotalLength() > TextEditorDefs::coldStorageChunkLength))
+        return false;
+
+    // the edges of any folds and inlays have to be kept apart
+    return (foldedRanges.isEmpty() && inlays.isEmpty())
+            || ! (isFoldBoundary (boundaryIndex) || isInlayPosition (boundaryIndex));
+}
+
+// joins the section at sectionIndex onto the one before it, if they're similar
+void UnicodeTextEditor::coalesceSectionsAt (int sectionIndex, int boundaryIndex)
+{
+    if (sectionIndex > 0 && sectionIndex < sections.size())
+    {
+        auto* s1 = sections.getUnchecked (sectionIndex - 1);
+        auto* s2 = sections.getUnchecked (sectionIndex);
+
+        if (canCoalesce (*s1, *s2, boundaryIndex))
+        {
+            s1->append (*s2);
+            sections.remove (sectionIndex);
+            sectionStarts.clearQuick();
+        }
+    }
 }
 
 void UnicodeTextEditor::coalesceSimilarSections()
 {
+    int index = 0;
+
     for (int i = 0; i < sections.size() - 1; ++i)
     {
         auto* s1 = sections.getUnchecked (i);
         auto* s2 = sections.getUnchecked (i + 1);
 
-        if (s1->font == s2->font
-             && s1->colour == s2->colour)
+        if (canCoalesce (*s1, *s2, index + s1->getTotalLength()))
         {
             s1->append (*s2);
             sections.remove (i + 1);
+            sectionStarts.clearQuick();
             --i;
         }
+        else
+        {
+            index += s1->getTotalLength();
+        }
+    }
+}
+
+void UnicodeTextEditor::textRangeChanged (int start, int numRemoved, int numInserted)
+{
+    lineIndex->textChanged (start, numRemoved, numInserted);
+    anchors->textChanged (start, numRemoved, numInserted);
+    decorations->textChanged (start, numRemoved, numInserted);
+
+    // folds that the edit touches get expanded, and the ones after it are moved along
+    const auto delta = numInserted - numRemoved;
+    auto firstUnhidden = start;
+
+    for (int i = foldedRanges.size(); --i >= 0;)
+    {
+        auto& fold = foldedRanges.getReference (i);
+
+        if (start >= fold.range.getEnd())
+            break;
+
+        if (start + numRemoved <= fold.range.getStart())
+        {
+            fold.range += delta;
+        }
+        else
+        {
+            juce::Range<int> expanded (juce::jmin (start, fold.range.getStart()),
+                                       juce::jmax (start + numInserted, fold.range.getEnd() + delta));
+
+            if (fold.hidden)
+                firstUnhidden = juce::jmin (firstUnhidden, fold.range.getStart());
+
+            foldedRanges.remove (i);
+            lineIndex->textChanged (expanded.getStart(), expanded.getLength(), expanded.getLength());
+        }
+    }
+
+    if (lineFilter != nullptr)
+        lineFilter->textChanged (firstUnhidden, numRemoved + (start - firstUnhidden), numInserted + (start - firstUnhidden));
+}
+
+int UnicodeTextEditor::countNewLines (juce::Range<int> range) const
+{
+    int index = 0, numNewLines = 0;
+
+    for (auto* s : sections)
+    {
+        if (index >= range.getEnd())
+            break;
+
+        auto nextIndex = index + s->getTotalLength();
+
+        if (nextIndex > range.getStart())
+        {
+            for (auto& atom : s->getAtoms())
+            {
+                if (range.contains (index) && atom.isNewLine())
+                    ++numNewLines;
+
+                index += atom.numChars;
+            }
+        }
+
+        index = nextIndex;
+    }
+
+    return numNewLines;
+}
+
+// Returns the index just after the last new-line in a range, or -1 if it has none. This
+// walks backwards from the end of the range, skipping any section that has no new-lines
+// without looking at its atoms, so it only costs as much as the text after the new-line.
+int UnicodeTextEditor::findEndOfLastNewLine (juce::Range<int> range) const
+{
+    if (range.isEmpty())
+        return -1;
+
+    int sectionStart = 0;
+    auto sectionIndex = findSectionContaining (range.getEnd() - 1, sectionStart);
+
+    if (sectionIndex >= sections.size())
+        return -1;
+
+    for (;;)
+    {
+        auto* section = sections.getUnchecked (sectionIndex);
+
+        if (section->getNumNewLines() > 0)
+        {
+            const auto& atoms = section->getAtoms();
+            auto atomIndex = section->findAtomContaining (range.getEnd() - 1 - sectionStart);
+
+            for (; atomIndex >= 0; --atomIndex)
+            {
+                const auto atomStart = sectionStart + section->getAtomStart (atomIndex);
+
+                if (atomStart < range.getStart())
+                    return -1;
+
+                if (atoms.getReference (atomIndex).isNewLine())
+                    return atomStart + atoms.getReference (atomIndex).numChars;
+            }
+        }
+
+        if (sectionStart <= range.getStart() || --sectionIndex < 0)
+            return -1;
+
+        sectionStart -= sections.getUnchecked (sectionIndex)->getTotalLength();
+    }
+}
+
+//==============================================================================
+int UnicodeTextEditor::getNumVisualLines() const
+{
+    return lineIndex->getNumLines();
+}
+
+const UnicodeTextEditor::LineSummary& UnicodeTextEditor::getLineSummary (int visualLineIndex) const
+{
+    auto numLines = lineIndex->getNumLines();
+    jassert (juce::isPositiveAndBelow (visualLineIndex, numLines));
+
+    return lineIndex->getLine (juce::jlimit (0, numLines - 1, visualLineIndex)).summary;
+}
+
+// The layout already numbers its lines, counting any folded new-lines before them, so only
+// the folds between the start of the visual line and the index need to be added.
+int UnicodeTextEditor::getLineNumberForIndex (int index) const
+{
+    index = juce::jlimit (0, getTotalNumChars(), index);
+
+    const auto& line = lineIndex->getLine (lineIndex->findLineContainingIndex (index));
+    auto lineNumber = line.logicalLine;
+
+    auto fold = std::upper_bound (foldedRanges.begin(), foldedRanges.end(), line.startIndex,
+                                  [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); });
+
+    for (; fold != foldedRanges.end() && fold->range.getEnd() <= index; ++fold)
+    {
+        // (hidden lines at the start of a visual line are already counted in its number)
+        if (! (fold->hidden && fold->range.getStart() == line.startIndex))
+            lineNumber += fold->numNewLines;
+    }
+
+    return lineNumber;
+}
+
+int UnicodeTextEditor::getColumnForIndex (int index) const
+{
+    index = juce::jlimit (0, getTotalNumChars(), index);
+
+    auto lineNum = lineIndex->findLineContainingIndex (index);
+
+    while (lineNum > 0 && ! lineIndex->getLine (lineNum).startsLogicalLine)
+        --lineNum;
+
+    auto lineStart = lineIndex->getLine (lineNum).startIndex;
+
+    // if a fold before the index has new-lines in it, the line starts after the last of them
+    auto fold = std::upper_bound (foldedRanges.begin(), foldedRanges.end(), lineStart,
+                                  [] (int i, const FoldedRange& f) { return i < f.range.getEnd(); });
+
+    const FoldedRange* lastFoldWithNewLines = nullptr;
+
+    for (; fold != foldedRanges.end() && fold->range.getEnd() <= index; ++fold)
+        if (fold->numNewLines > 0)
+            lastFoldWithNewLines = fold;
+
+    if (lastFoldWithNewLines != nullptr)
+        lineStart = juce::jmax (lineStart, findEndOfLastNewLine (lastFoldWithNewLines->range));
+
+    return index - lineStart;
+}
+
+//==============================================================================
+UnicodeTextEditor::Minimap::Minimap (UnicodeTextEditor& editorToShow)
+    : editor (&editorToShow)
+{
+    editorToShow.minimaps.add (this);
+}
+
+UnicodeTextEditor::Minimap::~Minimap()
+{
+    if (editor != nullptr)
+        editor->minimaps.removeFirstMatchingValue (this);
+}
+
+void UnicodeTextEditor::Minimap::setScale (float newPixelsPerLine, float newPixelsPerCharacter)
+{
+    jassert (newPixelsPerLine > 0 && newPixelsPerCharacter > 0);
+
+    pixelsPerLine = newPixelsPerLine;
+    pixelsPerCharacter = newPixelsPerCharacter;
+    repaint();
+}
+
+// When there are more lines than will fit, the overview scrolls in proportion to the editor.
+float UnicodeTextEditor::Minimap::getScrollOffset() const
+{
+    auto& viewport = *editor->viewport;
+    auto overviewHeight = (float) editor->getNumVisualLines() * pixelsPerLine;
+    auto scrollRange = editor->textHolder->getHeight() - viewport.getMaximumVisibleHeight();
+
+    if (overviewHeight <= (float) getHeight() || scrollRange <= 0)
+        return 0;
+
+    return (overviewHeight - (float) getHeight()) * (float) viewport.getViewPositionY() / (float) scrollRange;
+}
+
+void UnicodeTextEditor::Minimap::paint (juce::Graphics& g)
+{
+    if (editor == nullptr)
+        return;
+
+    g.fillAll (TextEditorDefs::findColourOrDefault (*this, backgroundColourId, editor->findColour (UnicodeTextEditor::backgroundColourId)));
+
+    auto& index = *editor->lineIndex;
+    const auto numLines = index.getNumLines();
+    const auto offset = getScrollOffset();
+    const auto clip = g.getClipBounds();
+    const auto width = (float) getWidth();
+
+    auto drawLine = [&] (int lineNum, float y, float height)
+    {
+        for (auto& run : index.getLine (lineNum).summary.runs)
+        {
+            const auto x = (float) run.start * pixelsPerCharacter;
+
+            if (x >= width)
+                break;
+
+            g.setColour (run.colour.withMultipliedAlpha (0.6f));
+            g.fillRect (x, y, juce::jmin ((float) run.length * pixelsPerCharacter, width - x), height);
+        }
+    };
+
+    if (pixelsPerLine >= 1.0f)
+    {
+        auto firstLine = juce::jmax (0, (int) (((float) clip.getY() + offset) / pixelsPerLine));
+        auto lastLine  = juce::jmin (numLines, (int) std::ceil (((float) clip.getBottom() + offset) / pixelsPerLine));
+
+        for (int i = firstLine; i < lastLine; ++i)
+            drawLine (i, (float) i * pixelsPerLine - offset, pixelsPerLine * 0.75f);
+    }
+    else
+    {
+        // With several lines to each row of pixels, drawing them all would only paint over the
+        // same pixels again, so each row shows the line in the middle of the ones it covers.
+        for (int row = clip.getY(); row < clip.getBottom(); ++row)
+        {
+            const auto firstLine = (int) (((float) row + offset) / pixelsPerLine);
+            const auto endLine   = juce::jmin (numLines, (int) (((float) row + 1.0f + offset) / pixelsPerLine));
+
+            if (firstLine >= numLines)
+                break;
+
+            if (firstLine < endLine)
+                drawLine ((firstLine + endLine) / 2, (float) row, 1.0f);
+        }
     }
+
+    // mark the part of the text that the editor is showing
+    auto textTop = (float) editor->viewport->getViewPositionY() - (float) editor->topIndent - index.getYOffset();
+    auto firstVisible = index.findLineAtY (textTop);
+    auto lastVisible  = index.findLineAtY (textTop + (float) editor->viewport->getMaximumVisibleHeight());
+
+    g.setColour (TextEditorDefs::findColourOrDefault (*this, visibleAreaColourId,
+                                                      editor->findColour (UnicodeTextEditor::highlightColourId).withMultipliedAlpha (0.3f)));
+    g.fillRect (0.0f, (float) firstVisible * pixelsPerLine - offset,
+                width, (float) (lastVisible - firstVisible + 1) * pixelsPerLine);
+}
+
+void UnicodeTextEditor::Minimap::mouseDown (const juce::MouseEvent& e)
+{
+    scrollEditorTo (e.position.y);
+}
+
+void UnicodeTextEditor::Minimap::mouseDrag (const juce::MouseEvent& e)
+{
+    scrollEditorTo (e.position.y);
+}
+
+void UnicodeTextEditor::Minimap::scrollEditorTo (float y)
+{
+    if (editor == nullptr)
+        return;
+
+    auto& index = *editor->lineIndex;
+    auto lineNum = juce::jlimit (0, index.getNumLines() - 1, (int) ((y + getScrollOffset()) / pixelsPerLine));
+    auto& line = index.getLine (lineNum);
+    auto& viewport = *editor->viewport;
+
+    auto lineCentre = (float) editor->topIndent + index.getYOffset() + line.y + line.height * 0.5f;
+
+    viewport.setViewPosition (viewport.getViewPositionX(),
+                              juce::roundToInt (lineCentre) - viewport.getMaximumVisibleHeight() / 2);
 }
 
 //==============================================================================
@@ -2717,7 +7525,7 @@ private:
         bool isDisplayingProtectedText() const override      { return unicodeTextEditor.getPasswordCharacter() != 0; }
         bool isReadOnly() const override                     { return unicodeTextEditor.isReadOnly(); }
 
-        int getTotalNumCharacters() const override           { return unicodeTextEditor.getText().length(); }
+        int getTotalNumCharacters() const override           { return unicodeTextEditor.getTotalNumChars(); }
         juce::Range<int> getSelection() const override             { return unicodeTextEditor.getHighlightedRegion(); }
 
         void setSelection (juce::Range<int> r) override
@@ -2729,7 +7537,7 @@ private:
         {
             if (isDisplayingProtectedText())
                 return juce::String::repeatedString (juce::String::charToString (unicodeTextEditor.getPasswordCharacter()),
-                                               getTotalNumCharacters());
+                                                     r.getIntersectionWith ({ 0, getTotalNumCharacters() }).getLength());
 
             return unicodeTextEditor.getTextInRange (r);
         }
@@ -79,6 +79,22 @@ public:
     /** Returns true if the editor is in multi-line mode. */
     bool isMultiLine() const;
 
+    /** Lets the editor put off rewrapping most of the text while its wrap width is changing.
+
+        When this is enabled, a change to the wrap width (e.g. while the editor is being
+        resized) only rewraps the lines down to the bottom of the visible area straight away.
+        The rest of the text is rewrapped once the width has stopped changing for a moment,
+        so until then the scrollbar range may be slightly out.
+
+        By default this is disabled.
+    */
+    void setDeferredRewrapEnabled (bool shouldDeferRewrap);
+
+    /** Returns true if deferred rewrapping is enabled.
+        @see setDeferredRewrapEnabled
+    */
+    bool isDeferredRewrapEnabled() const noexcept                   { return deferredRewrap; }
+
     //==============================================================================
     /** Changes the behaviour of the return key.
 
@@ -158,6 +174,273 @@ public:
     */
     bool areScrollbarsShown() const noexcept                        { return scrollbarVisible; }
 
+    /** Shows or hides a gutter down the left-hand side of the editor, containing line numbers.
+
+        The numbers refer to logical lines, i.e. lines of text separated by new-line characters,
+        so a line that has been word-wrapped only gets a number on its first visual line.
+
+        By default line numbers are hidden.
+        @see lineNumberTextColourId, lineNumberBackgroundColourId
+    */
+    void setLineNumbersShown (bool shouldBeShown);
+
+    /** Returns true if the line-number gutter is shown.
+        @see setLineNumbersShown
+    */
+    bool areLineNumbersShown() const noexcept                       { return lineNumbersShown; }
+
+    //==============================================================================
+    /** Collapses a range of the text, so that it's shown as a single placeholder.
+
+        The folded text is still part of the document, but it isn't laid out or drawn, and the
+        caret skips over it. Clicking on the placeholder, or editing any of the text inside the
+        range, expands it again. A range that overlaps or touches an existing fold is merged with it.
+
+        @see unfoldRange, unfoldAll, getFoldedRanges
+    */
+    void foldRange (juce::Range<int> rangeToFold);
+
+    /** Expands any folded ranges that intersect the given range.
+        @see foldRange
+    */
+    void unfoldRange (juce::Range<int> rangeToUnfold);
+
+    /** Expands all the folded ranges.
+        @see foldRange
+    */
+    void unfoldAll();
+
+    /** Returns the ranges that are currently folded, in order of their position in the text.
+        @see foldRange
+    */
+    juce::Array<juce::Range<int>> getFoldedRanges() const;
+
+    /** Shows only the lines of text that match a predicate, and hides the others.
+
+        The predicate is called with the text of each line, without its new-line character,
+        on a background thread, so it mustn't use anything that isn't safe to use from there.
+        The lines that fail it are hidden once the results come back. The text itself isn't
+        changed, and the lines keep their original numbers in the line-number gutter.
+
+        When text is added to the end, only the new lines are tested. Any other edit means
+        that all the lines get tested again.
+
+        Pass nullptr to show all the lines again.
+        @see isLineFilterActive
+    */
+    void setLineFilter (std::function<bool (const juce::String& lineText)> predicate);
+
+    /** Returns true if a line filter has been set.
+        @see setLineFilter
+    */
+    bool isLineFilterActive() const noexcept;
+
+    //==============================================================================
+    /** Limits how much of the text is held in its expanded, ready-to-draw form.
+
+        Once there's more text than this, the parts that have gone longest without being
+        shown are compressed, starting with the oldest text. They're expanded again when
+        they're next needed, e.g. when they're scrolled into view, or when their text is
+        read by getText() or a search. The positions of their lines are kept, so scrolling
+        past them doesn't need them expanding.
+
+        This is meant for logs and consoles that keep a lot of scrollback, where most of
+        the text is never looked at again. A limit of 0 (the default) turns it off.
+        @see getExpandedTextLimit
+    */
+    void setExpandedTextLimit (int maxNumExpandedChars);
+
+    /** Returns the limit set by setExpandedTextLimit(), or 0 if there isn't one.
+        @see setExpandedTextLimit
+    */
+    int getExpandedTextLimit() const noexcept                       { return expandedTextLimit; }
+
+    //==============================================================================
+    /** Which way an anchor moves when text is inserted exactly at its position.
+        @see addAnchor
+    */
+    enum class AnchorGravity
+    {
+        left,       /**< the anchor stays in front of the inserted text */
+        right       /**< the anchor moves along with the text that follows it */
+    };
+
+    /** Adds an anchor at a position in the text, and returns an ID that refers to it.
+
+        An anchor follows the text around it as it's edited, so it can be used to keep track of
+        things like bookmarks or diagnostics without having to adjust them after every change.
+        If the text around an anchor is deleted, it moves to the start of the deleted range.
+        Each edit costs a logarithmic amount of time to apply to the anchors, however many
+        there are.
+
+        Once an anchor has been removed, its ID may be handed out again for a new one.
+        @see getAnchorPosition, removeAnchor
+    */
+    int addAnchor (int index, AnchorGravity gravity);
+
+    /** Returns the character index that an anchor is currently at.
+        @see addAnchor
+    */
+    int getAnchorPosition (int anchorID) const;
+
+    /** Removes an anchor that was created with addAnchor().
+        @see addAnchor
+    */
+    void removeAnchor (int anchorID);
+
+    //==============================================================================
+    /** The ways in which a decoration can be drawn.
+        @see addDecoration
+    */
+    enum class DecorationStyle
+    {
+        background,     /**< fills the area behind the text */
+        underline,      /**< draws a straight line under the text */
+        squiggle,       /**< draws a wavy line under the text, as used to mark errors */
+        strikeThrough   /**< draws a line through the middle of the text */
+    };
+
+    /** Adds a decoration to a range of the text, and returns an ID that refers to it.
+
+        Decorations are drawn along with the text, but unlike changing the colour of the text
+        they don't affect its sections or the undo history. The range follows the text as it's
+        edited: text inserted inside it extends it, but text inserted at either end doesn't.
+
+        Only the decorations that are on screen are looked at when painting, so having a very
+        large number of them doesn't slow the editor down.
+
+        Once a decoration has been removed, its ID may be handed out again for a new one.
+        @see removeDecoration, clearDecorations, getDecorationRange
+    */
+    int addDecoration (juce::Range<int> range, DecorationStyle style, juce::Colour colour);
+
+    /** Removes a decoration that was created with addDecoration().
+        @see addDecoration
+    */
+    void removeDecoration (int decorationID);
+
+    /** Removes all the decorations.
+        @see addDecoration
+    */
+    void clearDecorations();
+
+    /** Returns the range of text that a decoration currently covers.
+        @see addDecoration
+    */
+    juce::Range<int> getDecorationRange (int decorationID) const;
+
+    //==============================================================================
+    /** Shows a piece of text at a position in the editor, without making it part of the content.
+
+        An inlay is laid out and drawn along with the text, for things like type hints or
+        annotations, but it isn't returned by getText(), doesn't take up any character indices,
+        and can't be edited or selected. The caret and mouse skip over it. It follows the text
+        that comes before it as that's edited.
+
+        Returns an ID that refers to the inlay. Once the inlay has been removed, the ID may be
+        handed out again.
+        @see setInlayText, removeInlay, clearInlays
+    */
+    int addInlay (int index, const juce::String& text, juce::Colour colour);
+
+    /** Changes the text of an inlay. Only the line that it's on needs to be laid out again.
+        @see addInlay
+    */
+    void setInlayText (int inlayID, const juce::String& newText);
+
+    /** Removes an inlay that was created with addInlay().
+        @see addInlay
+    */
+    void removeInlay (int inlayID);
+
+    /** Removes all the inlays.
+        @see addInlay
+    */
+    void clearInlays();
+
+    //==============================================================================
+    /** A rough outline of one visual line of text, as used to draw an overview of the editor's
+        contents, such as a Minimap.
+
+        The editor keeps these up to date as part of its layout, so reading them is cheap.
+        @see getLineSummary, Minimap
+    */
+    struct LineSummary
+    {
+        /** A stretch of text without any whitespace in it. */
+        struct Run
+        {
+            int start, length;      /**< in characters, relative to the start of the line */
+            juce::Colour colour;    /**< the colour used for most of the run's characters */
+        };
+
+        int indent = 0;             /**< the number of whitespace characters at the start of the line */
+        int length = 0;             /**< the number of characters shown, not counting any new-line */
+        juce::Array<Run> runs;
+    };
+
+    /** Returns the number of lines that the text currently occupies on screen, after word-wrapping
+        and folding have been applied.
+        @see getLineSummary
+    */
+    int getNumVisualLines() const;
+
+    /** Returns a summary of one of the visual lines.
+
+        The reference that is returned is only valid until the text or layout next changes.
+        @see getNumVisualLines
+    */
+    const LineSummary& getLineSummary (int visualLineIndex) const;
+
+    //==============================================================================
+    /**
+        Draws a miniature overview of the text in an editor, as a set of coloured bars.
+
+        The painting only reads the summaries that the editor keeps for each line, so it
+        costs the same however much text there is. Clicking or dragging on the overview
+        scrolls the editor.
+    */
+    class Minimap  : public juce::Component
+    {
+    public:
+        /** Creates a minimap that shows the given editor's contents. */
+        explicit Minimap (UnicodeTextEditor& editorToShow);
+
+        /** Destructor. */
+        ~Minimap() override;
+
+        /** Sets the size, in pixels, that each line and each character take up in the overview.
+            By default a line is 2 pixels high, and a character 1 pixel wide.
+        */
+        void setScale (float pixelsPerLine, float pixelsPerCharacter);
+
+        /** A set of colour IDs to use to change the colour of various aspects of the minimap. */
+        enum ColourIds
+        {
+            backgroundColourId  = 0x1000220, /**< The colour to fill the minimap with. If this isn't set, the
+                                                  editor's background colour is used. */
+
+            visibleAreaColourId = 0x1000221, /**< The colour used to mark the part of the text that is currently
+                                                  visible in the editor. */
+        };
+
+        /** @internal */
+        void paint (juce::Graphics&) override;
+        /** @internal */
+        void mouseDown (const juce::MouseEvent&) override;
+        /** @internal */
+        void mouseDrag (const juce::MouseEvent&) override;
+
+    private:
+        juce::Component::SafePointer<UnicodeTextEditor> editor;
+        float pixelsPerLine = 2.0f, pixelsPerCharacter = 1.0f;
+
+        float getScrollOffset() const;
+        void scrollEditorTo (float y);
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (Minimap)
+    };
+
     /** Changes the password character used to disguise the text.
 
         @param passwordCharacter    if this is not zero, this character will be used as a replacement
@@ -226,6 +509,12 @@ public:
 
         shadowColourId           = 0x1000207, /**< If this is non-transparent, it'll be used to draw an inner shadow
                                                    around the edge of the editor. */
+
+        lineNumberTextColourId       = 0x1000208, /**< The colour used for the numbers in the line-number gutter. If this
+                                                       isn't set, a faded version of the text colour is used. */
+
+        lineNumberBackgroundColourId = 0x1000209, /**< The colour with which to fill the line-number gutter. By default this
+                                                       is transparent. */
     };
 
     //==============================================================================
@@ -261,6 +550,23 @@ public:
     */
     void applyColourToAllText (const juce::Colour& newColour, bool changeCurrentTextColour = true);
 
+    /** Scales the way the text is laid out and drawn, without changing any of its fonts.
+
+        Unlike calling applyFontToAllText() with a bigger font, this doesn't measure the text
+        again: the widths that were measured for the unzoomed fonts are just scaled, so that
+        zooming stays quick on large documents. Once the zoom factor has stopped changing for a
+        moment, the visible lines are measured again at their zoomed size, so that they match
+        what the font would produce exactly.
+
+        @see getZoomFactor
+    */
+    void setZoomFactor (float newZoomFactor);
+
+    /** Returns the current zoom factor.
+        @see setZoomFactor
+    */
+    float getZoomFactor() const noexcept                            { return zoomFactor; }
+
     /** Sets whether whitespace should be underlined when the editor font is underlined.
 
         @see isWhitespaceUnderlined
@@ -351,6 +657,16 @@ public:
     /** You can assign a lambda to this callback object to have it called when the editor loses key focus. */
     std::function<void()> onFocusLost;
 
+    /** You can assign a lambda to this callback object to follow the progress of a big copy.
+
+        Copying a selection of a few million characters or more is done in small slices, so
+        that the editor stays responsive. This is called after each slice with the proportion
+        that has been copied so far, and with 1.0 once the text is on the clipboard. Editing the
+        text doesn't affect a copy that's under way, but if another copy is started before
+        it has finished, it's abandoned and this is called with -1.0.
+    */
+    std::function<void (double progress)> onCopyProgress;
+
     //==============================================================================
     /** Returns the entire contents of the editor. */
     juce::String getText() const;
@@ -378,6 +694,19 @@ public:
     void setText (const juce::String& newText,
                   bool sendTextChangeMessage = true);
 
+    /** Sets the entire content of the editor, using any measurements of the new text that
+        were saved in a cache directory by saveLayoutCache().
+
+        This is like calling setText() and then loadLayoutCache(), except that the cached
+        widths are applied before anything is laid out, so none of the text is measured
+        or laid out twice. If there's no cache for the text, it's measured as usual.
+
+        @see setText, saveLayoutCache, loadLayoutCache
+    */
+    void setText (const juce::String& newText,
+                  const juce::File& layoutCacheDirectory,
+                  bool sendTextChangeMessage = true);
+
     /** Returns a Value object that can be used to get or set the text.
 
         Bear in mind that this operate quite slowly if your text box contains large
@@ -401,6 +730,83 @@ public:
     /** Deletes all the text from the editor. */
     void clear();
 
+    //==============================================================================
+    /** A document that has been taken out of an editor by saveState().
+
+        This holds everything that belongs to the text rather than to the editor: the text
+        itself and its layout, the undo history, the anchors, decorations, folds and inlays,
+        the line filter, the selection, and the scroll position. It can only be given back
+        to the editor that it came from, and mustn't outlive that editor.
+
+        @see UnicodeTextEditor::saveState, UnicodeTextEditor::restoreState
+    */
+    class DocumentState
+    {
+    public:
+        /** Creates an empty state. */
+        DocumentState() noexcept;
+        ~DocumentState();
+
+        DocumentState (DocumentState&&) noexcept;
+        DocumentState& operator= (DocumentState&&) noexcept;
+
+        /** Returns true if this doesn't hold a document. */
+        bool isEmpty() const noexcept                               { return contents == nullptr; }
+
+    private:
+        friend class UnicodeTextEditor;
+        struct Contents;
+        std::unique_ptr<Contents> contents;
+
+        explicit DocumentState (std::unique_ptr<Contents>) noexcept;
+
+        JUCE_DECLARE_NON_COPYABLE (DocumentState)
+    };
+
+    /** Takes the document out of the editor, leaving the editor empty.
+
+        Nothing gets copied or laid out again, so switching an editor between several
+        documents with saveState() and restoreState() only costs a repaint, and each one
+        keeps its caret, selection, scroll position and undo history.
+        @see restoreState
+    */
+    DocumentState saveState();
+
+    /** Puts a document that was taken out by saveState() back into the editor.
+
+        The document that the editor was showing is deleted, so call saveState() first if
+        you want to keep it.
+        @see saveState
+    */
+    void restoreState (DocumentState&& state);
+
+    //==============================================================================
+    /** Saves the measurements of the text into a cache directory, so that they can be
+        reused by loadLayoutCache() the next time the same text is shown.
+
+        Each file in the directory is named after a hash of the text and of the fonts it's
+        shown in, so one directory can hold the caches for any number of documents. Only
+        the text that has been measured is saved, so this is best called once the layout
+        has had a chance to finish, e.g. when the document is closed.
+
+        Nothing is saved, and this returns false, if some of the text has been compressed
+        to stay within the limit set by setExpandedTextLimit(), as all of it would have to be
+        expanded again to save it. It also returns false if the file couldn't be written.
+        @see loadLayoutCache, setExpandedTextLimit
+    */
+    bool saveLayoutCache (const juce::File& cacheDirectory) const;
+
+    /** Loads measurements saved by saveLayoutCache(), so that the text doesn't have to be
+        measured again. Call this straight after setText(), or use the version of setText()
+        that takes the cache directory, which avoids laying out the first screen twice.
+
+        Returns false, and leaves the editor alone, if there's no cache for the editor's
+        current text and fonts in the directory, or if some of the text has been compressed
+        (see saveLayoutCache()).
+        @see saveLayoutCache
+    */
+    bool loadLayoutCache (const juce::File& cacheDirectory);
+
     /** Deletes the currently selected region.
         This doesn't copy the deleted section to the clipboard - if you need to do that, call copy() first.
         @see copy, paste, SystemClipboard
@@ -459,6 +865,43 @@ public:
     /** Returns the section of text that is currently selected. */
     juce::String getHighlightedText() const;
 
+    //==============================================================================
+    /** Adds another selection alongside the main one, or another caret if the range is empty.
+
+        While there's more than one selection, anything that's typed, pasted or deleted is
+        applied at all of them at once, as a single undoable change. The extra selections
+        follow the text as it's edited, and are removed when the caret is moved with the mouse
+        or the cursor keys, or when escape is pressed. Alt-clicking also adds a caret. If the
+        new selection overlaps or touches any extra ones, they're joined into one.
+        @see getSelections, clearExtraSelections
+    */
+    void addSelection (juce::Range<int> newSelection);
+
+    /** Returns all the selections, including the main one, in the order they appear in the
+        text. Any that overlap or touch each other are merged.
+        @see addSelection
+    */
+    juce::Array<juce::Range<int>> getSelections() const;
+
+    /** Removes any selections that were added with addSelection(), leaving only the main one. */
+    void clearExtraSelections();
+
+    /** Returns true if there are any selections besides the main one. */
+    bool hasExtraSelections() const noexcept                            { return ! extraSelections.isEmpty(); }
+
+    /** Selects a rectangular block of text, i.e. the characters on each line that lie between
+        the left and right edges of the rectangle with these two corners.
+
+        Each line gets a selection of its own, as if added with addSelection(), so whatever is
+        typed or deleted is applied to every line, and copying puts the lines on the clipboard
+        separated by new-lines. The main selection is the one on the line of the second corner.
+        Dragging the mouse with the alt key held down makes a box selection.
+
+        The coordinates are relative to the component's top-left.
+        @see addSelection
+    */
+    void setBoxSelection (juce::Point<int> corner1, juce::Point<int> corner2);
+
     /** Finds the index of the character at a given position.
         The coordinates are relative to the component's top-left.
     */
@@ -481,6 +924,31 @@ public:
     */
     int getTotalNumChars() const override;
 
+    /** Returns the number of lines in the text, i.e. one more than the number of new-lines.
+
+        Unlike getNumVisualLines(), this isn't affected by word-wrapping or folding. The editor
+        keeps this and getNumWords() up to date as the text is edited, so they're cheap to call.
+        @see getNumWords, getLineNumberForIndex
+    */
+    int getNumLines() const noexcept                                  { return newLineCount + 1; }
+
+    /** Returns the number of words in the text, where a word is any run of characters
+        that aren't whitespace.
+        @see getNumLines
+    */
+    int getNumWords() const noexcept                                  { return wordCount; }
+
+    /** Returns the zero-based number of the line that contains a character index, e.g. to show
+        where the caret is. This is looked up in the layout, so is quick however long the text is.
+        @see getColumnForIndex, getCaretPosition
+    */
+    int getLineNumberForIndex (int index) const;
+
+    /** Returns the number of characters between a character index and the start of its line.
+        @see getLineNumberForIndex
+    */
+    int getColumnForIndex (int index) const;
+
     /** Returns the total width of the text, as it is currently laid-out.
 
         This may be larger than the size of the UnicodeTextEditor, and can change when
@@ -758,9 +1226,24 @@ private:
     struct TextEditorViewport;
     struct InsertAction;
     struct RemoveAction;
+    struct MultiReplaceAction;
+    struct LineIndex;
+    struct LineNumberGutter;
+    struct LayoutTimer;
+    struct AnchorTree;
+    struct DecorationTree;
+    struct LineFilter;
+    struct ClipboardWriter;
     class EditorAccessibilityHandler;
 
+    std::unique_ptr<LineIndex> lineIndex;
+    std::unique_ptr<AnchorTree> anchors;
+    std::unique_ptr<DecorationTree> decorations;
+    std::unique_ptr<LineFilter> lineFilter;
+    std::unique_ptr<ClipboardWriter> clipboardWriter;
     std::unique_ptr<juce::Viewport> viewport;
+    std::unique_ptr<LineNumberGutter> lineNumberGutter;
+    std::unique_ptr<LayoutTimer> layoutTimer;
     TextHolderComponent* textHolder;
     juce::BorderSize<int> borderSize { 1, 1, 1, 3 };
     juce::Justification justification { juce::Justification::topLeft };
@@ -782,8 +1265,13 @@ private:
     bool underlineWhitespace = true;
     bool mouseDownInEditor = false;
     bool clicksOutsideDismissVirtualKeyboard = false;
+    bool lineNumbersShown = false;
+    bool deferredRewrap = false;
+    bool atomWidthsNeedRefining = false;
+    bool batchingEdits = false;
+    bool draggingBox = false;
 
-    juce::UndoManager undoManager;
+    std::unique_ptr<juce::UndoManager> undoManager { std::make_unique<juce::UndoManager>() };
     std::unique_ptr<juce::CaretComponent> caret;
     juce::Range<int> selection;
     int leftIndent = 4, topIndent = 4;
@@ -791,7 +1279,20 @@ private:
     juce::Font currentFont { 14.0f };
     mutable int totalNumChars = 0;
     int caretPosition = 0;
+    int expandedTextLimit = 0;
+
+    // shared by this editor's sections, for finding the ones that have gone longest without
+    // being used, and telling whether any have been expanded since the last compression
+    struct SectionClock
+    {
+        juce::uint32 time = 0, expansionCount = 0;
+    };
+
+    SectionClock sectionClock;
+    juce::uint32 expansionCountWhenCompressed = 0;
+    int wordCount = 0, newLineCount = 0;
     juce::OwnedArray<UniformTextSection> sections;
+    mutable juce::Array<int> sectionStarts;     // cleared whenever the sections change, see findSectionContaining()
     juce::String textToShowWhenEmpty;
     juce::Colour colourForTextWhenEmpty;
     juce::juce_wchar passwordCharacter;
@@ -799,6 +1300,7 @@ private:
     juce::Value textValue;
     VirtualKeyboardType keyboardType = juce::TextInputTarget::textKeyboard;
     float lineSpacing = 1.0f;
+    float zoomFactor = 1.0f;
 
     enum DragType
     {
@@ -812,17 +1314,82 @@ private:
     juce::ListenerList<Listener> listeners;
     juce::Array<juce::Range<int>> underlinedSections;
 
+    struct FoldedRange
+    {
+        juce::Range<int> range;
+        int numNewLines;
+        bool hidden;        // hidden by the line filter, rather than folded with a placeholder
+    };
+
+    juce::Array<FoldedRange> foldedRanges;
+    juce::Array<Minimap*> minimaps;
+
+    struct Inlay
+    {
+        int anchorID;
+        juce::String text;
+        juce::Colour colour;
+        mutable float width = -1.0f;    // measured with measuredFont when it's first laid out
+        mutable juce::Font measuredFont;
+    };
+
+    juce::Array<Inlay> inlays;
+
+    struct ExtraSelection
+    {
+        int startAnchorID, endAnchorID;     // both with right gravity, so typing pushes them along
+    };
+
+    // (kept in order, with both their starts and their ends ascending, so that the ones on
+    // screen can be found with a binary search)
+    juce::Array<ExtraSelection> extraSelections;
+    juce::Point<int> boxSelectionStart;
+
     std::unique_ptr<juce::AccessibilityHandler> createAccessibilityHandler() override;
     void moveCaret (int newCaretPos);
     void moveCaretTo (int newPosition, bool isSelecting);
     void recreateCaret();
     void handleCommandMessage (int) override;
     void coalesceSimilarSections();
+    void coalesceSectionsAt (int sectionIndex, int boundaryIndex);
+    bool canCoalesce (const UniformTextSection&, const UniformTextSection&, int boundaryIndex) const;
     void splitSection (int sectionIndex, int charToSplitAt);
+    int findSectionContaining (int index, int& sectionStart) const;
+    void splitSectionsAt (int index);
+    void splitSectionsAt (const juce::Array<int>& sortedIndices);
+    int splitIntoChunks (int firstSection, int endSection);
+    void textRangeChanged (int start, int numRemoved, int numInserted);
+    void foldsChanged();
+    void replaceHiddenRanges (int start, const juce::Array<FoldedRange>&);
+    int findFoldContaining (int index) const noexcept;
+    bool isFoldBoundary (int index) const noexcept;
+    int countNewLines (juce::Range<int>) const;
+    int findEndOfLastNewLine (juce::Range<int>) const;
+    juce::Range<int> getFoldedRangeAt (juce::Point<int>) const;
+    int getInlayPosition (int inlayIndex) const;
+    int findInlayAtOrAfter (int index) const;
+    int findInlay (int inlayID) const;
+    bool isInlayPosition (int index) const;
+    void inlayChanged (int index);
     void clearInternal (juce::UndoManager*);
     void insert (const juce::String&, int insertIndex, const juce::Font&, juce::Colour, juce::UndoManager*, int newCaretPos);
-    void reinsert (int insertIndex, const juce::OwnedArray<UniformTextSection>&);
-    void remove (juce::Range<int>, juce::UndoManager*, int caretPositionToMoveTo);
+    void insert (std::unique_ptr<UniformTextSection>, int insertIndex, juce::UndoManager*, int newCaretPos);
+    void reinsert (int insertIndex, juce::OwnedArray<UniformTextSection>&);
+    void remove (juce::Range<int>, juce::UndoManager*, int caretPositionToMoveTo,
+                 juce::OwnedArray<UniformTextSection>* removedSections = nullptr);
+    void insertSection (std::unique_ptr<UniformTextSection>, int insertIndex);
+    void removeSections (juce::Range<int>, juce::OwnedArray<UniformTextSection>* removedSections);
+    void updateTextCounts (int firstSection, int endSection, int sign);
+    void replaceSelections (std::unique_ptr<UniformTextSection>);
+    void replaceRanges (const juce::Array<juce::Range<int>>&, const UniformTextSection&,
+                        juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& removedSections, int newCaretPos);
+    void restoreRanges (const juce::Array<juce::Range<int>>&, int replacementLength,
+                        juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& removedSections, int newCaretPos);
+    void spliceRanges (const juce::Array<juce::Range<int>>&, const UniformTextSection* newSection,
+                       juce::OwnedArray<juce::OwnedArray<UniformTextSection>>& sectionArrays);
+    void finishBatchedEdit (int firstChangedIndex, int newCaretPos);
+    juce::Range<int> getExtraSelection (const ExtraSelection&) const;
+    void setExtraSelection (ExtraSelection&, juce::Range<int>);
     void getCharPosition (int index, juce::Point<float>&, float& lineHeight) const;
     void updateCaretPosition();
     void updateValueFromText();
@@ -844,6 +1411,17 @@ private:
     juce::UndoManager* getUndoManager() noexcept;
     void setSelection (juce::Range<int>) noexcept;
     juce::Point<int> getTextOffset() const noexcept;
+    int getLineNumberGutterWidth() const;
+    void refineVisibleAtomWidths();
+    juce::Range<int> getVisibleTextRange() const;
+    int getNumBytesAsUTF8 (juce::Range<int>) const;
+    void copySelection (bool allowDeferring);
+    void abandonDeferredCopy();
+    void swapDocument (DocumentState::Contents&);
+    bool hasCompressedSections() const noexcept;
+    juce::File getLayoutCacheFile (const juce::File& cacheDirectory, int& numAtoms) const;
+    bool readLayoutCache (const juce::File& cacheDirectory);
+    void compressColdSections();
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (UnicodeTextEditor)
 };